@@ -1,12 +1,34 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
 #include <linux/acpi.h>
+#include <linux/bpf.h>
+#include <linux/bpf_verifier.h>
+#include <linux/btf.h>
+#include <linux/completion.h>
+#include <linux/cpuhotplug.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
 #include <linux/device.h>
 #include <linux/dmi.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
+#include <linux/kernel_stat.h>
+#include <linux/kthread.h>
+#include <linux/led-class-multicolor.h>
+#include <linux/leds.h>
 #include <linux/module.h>
+#include <linux/perf_event.h>
 #include <linux/platform_device.h>
+#include <linux/power_supply.h>
+#include <linux/rcupdate.h>
+#include <linux/sched/isolation.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
+#include <linux/tick.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+#include "gigabyte-wmi.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Slava Andrejev");
@@ -267,10 +289,67 @@ static const struct gb_get_method_out_descr
 		GB_GET_METHOD_OUT_SIZE(GB_METHOD_CHECK_3G_MODULE, 1, u16),
 	};
 
+// Settings that can be bundled into a profile, in the order they are applied.
+struct gb_profile_field {
+	const char *name;
+	u32 method_id;
+	u32 max;
+	const char *wmi_name; // set method as it is logged
+};
+
+static const struct gb_profile_field gb_profile_fields[] = {
+	{ "dynamic_boost_status", GB_METHOD_DYNAMIC_BOOST, 1,
+	  "SetDynamicBoostStatus" },
+	{ "nv_power_config", GB_METHOD_NV_POWER_CONFIG, U8_MAX,
+	  "SetNvPowerConfig" },
+	{ "whisper_mode", GB_METHOD_WHISPER_MODE, 1, "SetWhisperMode" },
+	{ "current_fan_step", GB_METHOD_FAN_STEP, U8_MAX,
+	  "SetCurrentFanStepData" },
+	{ "fixed_fan_status", GB_METHOD_FIXED_FAN_STATUS, 1,
+	  "SetFixedFanStatus" },
+	{ "step_fan_status", GB_METHOD_STEP_FAN_STATUS, 1, "SetStepFanStatus" },
+	{ "auto_fan_status", GB_METHOD_AUTO_FAN_STATUS, 1, "SetAutoFanStatus" },
+	{ "nv_thermal_target", GB_METHOD_NV_THERMAL_TARGET, U8_MAX,
+	  "SetNvThermalTarget" },
+	{ "fixed_fan_speed", GB_METHOD_FIXED_FAN_SPEED, U8_MAX,
+	  "SetFanFixedSpeed" },
+	{ "cpu_fan_duty", GB_METHOD_CPU_FAN_DUTY, U8_MAX, "SetCPUFanDuty" },
+	{ "gpu_fan_duty", GB_METHOD_GPU_FAN_DUTY, U8_MAX, "SetGPUFanDuty" },
+};
+
+struct gb_profile {
+	u32 mask; // bit per gb_profile_fields entry present in the profile
+	u32 value[ARRAY_SIZE(gb_profile_fields)];
+};
+
+// EC register that holds the value returned by a get method.
+struct gb_ec_reg {
+	u32 method_id;
+	u8 offset;
+	u8 width; // in bytes, little endian
+};
+
+struct gb_model {
+	// EC registers the get methods read, terminated by an entry with
+	// zero width. They are verified against WMI before use.
+	const struct gb_ec_reg *ec_regs;
+	// SetRGBLed has no get counterpart to probe it with, so the models
+	// with the LED are listed.
+	bool rgb_led;
+};
+
+// The EC layout of this model is not confirmed yet, the ec_map module
+// parameter can be used to try offsets.
+static const struct gb_model gb_model_aero_16_ye5 = {};
+
+static const struct gb_model *gb_model;
+
 static int dmi_check_cb(const struct dmi_system_id *dmi)
 {
 	pr_info("Computer model: '%s'\n", dmi->ident);
 
+	gb_model = dmi->driver_data;
+
 	return 1;
 }
 
@@ -279,23 +358,990 @@ static const struct dmi_system_id gigabyte_supported_platforms[] __initconst = {
 	  .matches = { DMI_MATCH(DMI_SYS_VENDOR, "GIGABYTE"),
 		       DMI_MATCH(DMI_PRODUCT_NAME, "AERO 16 YE5"),
 		       DMI_MATCH(DMI_PRODUCT_SKU, "P86YE5") },
-	  .callback = dmi_check_cb }
+	  .callback = dmi_check_cb,
+	  .driver_data = (void *)&gb_model_aero_16_ye5 }
+};
+
+static char *ec_map;
+module_param(ec_map, charp, 0444);
+MODULE_PARM_DESC(ec_map,
+		 "Extra EC registers for the fast path as method:offset:width,...");
+
+static const struct gb_ec_ops gb_ec_default_ops = { .read = ec_read };
+
+// gb_ec_ops is changed under get_lock, the gb_ec_fast entries are accessed
+// under gb_wmi_lock, since sensor reads do not take get_lock. An entry with
+// zero width has no verified EC register and is served through WMI.
+static const struct gb_ec_ops *gb_ec_ops = &gb_ec_default_ops;
+static struct gb_ec_reg gb_ec_fast[GB_METHOD_LAST];
+
+static char *boot_profile;
+module_param_named(profile, boot_profile, charp, 0444);
+MODULE_PARM_DESC(profile,
+		 "Profile applied when the driver loads, as name=value,...");
+
+// Sensors sampled periodically by the driver.
+enum gb_sensor {
+	GB_SENSOR_CPU_TEMP,
+	GB_SENSOR_GPU_TEMP1,
+	GB_SENSOR_GPU_TEMP2,
+	GB_SENSOR_RPM1,
+	GB_SENSOR_RPM2,
+	GB_SENSOR_COUNT
+};
+
+static const u32 gb_sensor_method[GB_SENSOR_COUNT] = {
+	[GB_SENSOR_CPU_TEMP] = GB_METHOD_CPU_TEMP,
+	[GB_SENSOR_GPU_TEMP1] = GB_METHOD_GPU_TEMP1,
+	[GB_SENSOR_GPU_TEMP2] = GB_METHOD_GPU_TEMP2,
+	[GB_SENSOR_RPM1] = GB_METHOD_RPM1,
+	[GB_SENSOR_RPM2] = GB_METHOD_RPM2,
+};
+
+#define GB_STATS_MAX_SAMPLES 600
+
+// Ring of the most recent samples of one sensor plus its moving average.
+struct gb_sensor_stats {
+	u16 samples[GB_STATS_MAX_SAMPLES];
+	unsigned int head;
+	unsigned int count;
+	s64 ema; // in thousandths
+};
+
+#define GB_FAN_COUNT 2
+
+// Throttle and fan stall detection, fed by the sampler.
+struct gb_throttle {
+	unsigned int cpu_limit; // the CPU throttles at this temperature
+	unsigned int margin; // degrees below a limit that count as near it
+	unsigned int stall_temp; // a fan at 0 RPM above this is stalled
+	bool target_valid;
+	u8 thermal_target; // GPU thermal target reported by the firmware
+	bool health_valid;
+	u8 fan_health; // raw GetFanHealth value
+	bool cpu_near;
+	bool gpu_near;
+	bool stalled[GB_FAN_COUNT];
+	u32 cpu_events;
+	u32 gpu_events;
+	u32 stall_events;
+	u64 cpu_ms; // total time near the limit
+	u64 gpu_ms;
+	// Boot time in seconds of the last event, 0 if there was none.
+	time64_t cpu_last;
+	time64_t gpu_last;
+	time64_t stall_last;
+	u64 last_ns; // when the previous sample was accounted
+};
+
+// Values exposed as perf events. The sensors come first, in gb_sensor order.
+enum gb_pmu_event {
+	GB_PMU_CPU_FAN_DUTY = GB_SENSOR_COUNT,
+	GB_PMU_GPU_FAN_DUTY,
+	GB_PMU_EVENT_COUNT
+};
+
+// Values a BPF policy can set on every sampler tick.
+enum gb_policy_target {
+	GB_POLICY_CPU_FAN_DUTY,
+	GB_POLICY_GPU_FAN_DUTY,
+	GB_POLICY_DYNAMIC_BOOST,
+	GB_POLICY_WHISPER_MODE,
+	GB_POLICY_AI_BOOST,
+	GB_POLICY_TARGET_COUNT
+};
+
+// A target the policy leaves at this value is not changed.
+#define GB_POLICY_KEEP -1
+
+static const struct {
+	const char *name;
+	u32 method_id;
+	u32 max;
+} gb_policy_targets[GB_POLICY_TARGET_COUNT] = {
+	[GB_POLICY_CPU_FAN_DUTY] = { "cpu_fan_duty", GB_METHOD_CPU_FAN_DUTY,
+				     U8_MAX },
+	[GB_POLICY_GPU_FAN_DUTY] = { "gpu_fan_duty", GB_METHOD_GPU_FAN_DUTY,
+				     U8_MAX },
+	[GB_POLICY_DYNAMIC_BOOST] = { "dynamic_boost", GB_METHOD_DYNAMIC_BOOST,
+				      1 },
+	[GB_POLICY_WHISPER_MODE] = { "whisper_mode", GB_METHOD_WHISPER_MODE,
+				     1 },
+	[GB_POLICY_AI_BOOST] = { "ai_boost", GB_METHOD_AI_BOOST_STATUS, 1 },
+};
+
+// Passed to the tick callback of a BPF policy. The sensor fields are inputs,
+// the policy writes the targets it wants applied.
+struct gb_policy_state {
+	u32 valid; // bit per gb_sensor that has a reading in sensors
+	u16 sensors[GB_SENSOR_COUNT];
+	u32 load; // CPU load in percent since the previous tick
+	u32 interval_ms;
+	u64 time_ns; // boot time of the sample
+	s32 target[GB_POLICY_TARGET_COUNT];
+};
+
+// BPF struct_ops implemented by a fan and boost policy.
+struct gb_policy_ops {
+	int (*tick)(struct gb_policy_state *state);
+	char name[16];
+};
+
+// The attached policy, at most one at a time. Written with gb_policy_lock
+// held, which also keeps the driver from unbinding under an attach.
+static struct gb_policy_ops __rcu *gb_policy;
+static DEFINE_MUTEX(gb_policy_lock);
+
+struct gb_sampler {
+	struct delayed_work work;
+	struct mutex lock;
+	unsigned int users; // the sampler runs while somebody needs the data
+	unsigned int interval_ms;
+	unsigned int window_s;
+	bool stats_enabled;
+	bool throttle_enabled;
+	unsigned long valid; // bit per sensor that has a reading in latest
+	u16 latest[GB_SENSOR_COUNT];
+	struct gb_sensor_stats stats[GB_SENSOR_COUNT];
+	struct gb_throttle throttle;
+	// Bookkeeping of the BPF policy, only used by the work. The work resets
+	// it when policy_gen, bumped under lock on every attach, changes.
+	unsigned int policy_gen;
+	unsigned int policy_seen;
+	s32 policy_applied[GB_POLICY_TARGET_COUNT];
+	u64 policy_idle;
+	u64 policy_wall;
+	// Time integrals of the values for the perf PMU, in value
+	// microseconds. Read from perf callbacks, which cannot sleep.
+	seqlock_t pmu_seq;
+	unsigned int pmu_users; // protected by lock
+	u64 pmu_stamp; // ns of the last update, 0 before the first sample
+	u16 pmu_value[GB_PMU_EVENT_COUNT];
+	u64 pmu_total[GB_PMU_EVENT_COUNT];
+};
+
+enum gb_led {
+	GB_LED_LIGHT_BAR,
+	GB_LED_RGB,
+	GB_LED_KBD_BACKLIGHT,
+	GB_LED_COUNT
+};
+
+struct gb_leds {
+	struct mutex lock;
+	// In frame mode LED changes are only staged, leds/commit sends every
+	// changed LED to the EC in one go.
+	bool frame_mode;
+	unsigned long dirty; // bit per gb_led with staged changes
+	unsigned long present; // bit per gb_led that is registered
+	struct led_classdev_mc light_bar;
+	struct mc_subled light_bar_subleds[3];
+	struct led_classdev_mc rgb;
+	struct mc_subled rgb_subleds[3];
+	struct led_classdev kbd_backlight;
+};
+
+struct gb_write_req {
+	struct list_head node;
+	u32 method_id;
+	u32 value;
+	u64 first_seq; // sequence number the request was queued with
+	u64 seq; // sequence number of the latest write it carries
+};
+
+// Queue of set calls executed in the background when async mode is on.
+struct gb_write_queue {
+	struct work_struct work;
+	spinlock_t lock;
+	struct list_head pending;
+	bool enabled;
+	u64 submitted; // sequence number of the last queued write
+	u64 completed; // sequence number of the last executed write
+	int last_error;
+	u64 last_error_seq;
+};
+
+// Load-adaptive switching between the quiet and the boost performance states.
+struct gb_governor {
+	struct delayed_work work;
+	struct mutex lock;
+	bool enabled;
+	bool valid; // state below reflects what was written to the EC
+	bool boosted;
+	unsigned int period_ms;
+	unsigned int up_threshold; // CPU load in percent to switch to boost
+	unsigned int down_threshold; // CPU load in percent to switch to quiet
+	unsigned int boost_dwell_ms; // minimum time to stay boosted
+	unsigned int quiet_dwell_ms; // minimum time to stay quiet
+	unsigned int load;
+	u8 heavy;
+	unsigned long switched;
+	u64 prev_idle;
+	u64 prev_wall;
+};
+
+enum gb_turbo_phase {
+	GB_TURBO_IDLE,
+	GB_TURBO_BOOST,
+	GB_TURBO_COOLDOWN,
+};
+
+// Settings changed for a turbo burst. The fan settings follow the
+// performance ones, they are restored only after the cooldown.
+enum gb_turbo_setting {
+	GB_TURBO_DYNAMIC_BOOST,
+	GB_TURBO_MODE,
+	GB_TURBO_SMART_LEVEL,
+	GB_TURBO_AUTO_FAN,
+	GB_TURBO_FIXED_FAN_STATUS,
+	GB_TURBO_FIXED_FAN_SPEED,
+	GB_TURBO_GPU_FAN_DUTY,
+	GB_TURBO_SETTING_COUNT
+};
+
+#define GB_TURBO_FIRST_FAN GB_TURBO_AUTO_FAN
+
+// Time-boxed turbo bursts that end early once a heat budget is used up.
+struct gb_turbo {
+	struct delayed_work work;
+	struct mutex lock;
+	enum gb_turbo_phase phase;
+	unsigned int budget; // degree seconds above the limits a burst may use
+	unsigned int cpu_limit; // CPU temperature the heat is counted above
+	unsigned int fan_duty;
+	unsigned int cooldown_s; // longest time the fans stay up after a burst
+	unsigned int smart_turbo_level; // 0 leaves the level alone
+	u8 gpu_limit; // GPU thermal target when the burst started
+	u64 heat; // degree milliseconds used by the current burst
+	u64 deadline_ns;
+	u64 last_ns;
+	const char *ended; // why the last burst ended
+	unsigned long saved_valid; // bit per gb_turbo_setting in saved
+	u32 saved[GB_TURBO_SETTING_COUNT];
+};
+
+// Methods of the settings a burst changes.
+static const struct {
+	u32 get_id;
+	u32 set_id;
+} gb_turbo_settings[GB_TURBO_SETTING_COUNT] = {
+	[GB_TURBO_DYNAMIC_BOOST] = { GB_METHOD_DYNAMIC_BOOST,
+				     GB_METHOD_DYNAMIC_BOOST },
+	[GB_TURBO_MODE] = { GB_METHOD_TURBO_MODE, GB_METHOD_TURBO_MODE },
+	[GB_TURBO_SMART_LEVEL] = { GB_METHOD_GET_SMART_TURBO_LEVEL,
+				   GB_METHOD_SET_SMART_TURBO_LEVEL },
+	[GB_TURBO_AUTO_FAN] = { GB_METHOD_AUTO_FAN_STATUS,
+				GB_METHOD_AUTO_FAN_STATUS },
+	[GB_TURBO_FIXED_FAN_STATUS] = { GB_METHOD_FIXED_FAN_STATUS,
+					GB_METHOD_FIXED_FAN_STATUS },
+	[GB_TURBO_FIXED_FAN_SPEED] = { GB_METHOD_FIXED_FAN_SPEED,
+				       GB_METHOD_FIXED_FAN_SPEED },
+	[GB_TURBO_GPU_FAN_DUTY] = { GB_METHOD_GPU_FAN_DUTY,
+				    GB_METHOD_GPU_FAN_DUTY },
+};
+
+// Profiles applied automatically when the machine goes on or off AC.
+struct gb_power_profiles {
+	struct notifier_block nb;
+	struct work_struct work;
+	struct mutex lock;
+	bool auto_switch;
+	int ac_online; // -1 until the first power supply event
+	struct gb_profile ac;
+	struct gb_profile battery;
+};
+
+// Snapshot values read with the slow battery methods. They are refreshed in
+// the background, so a snapshot read never waits for the battery.
+struct gb_snapshot_cache {
+	struct work_struct work;
+	spinlock_t lock;
+	unsigned long valid; // bit per gb_snapshot_fields entry
+	u32 value[BITS_PER_LONG];
+	unsigned long updated; // last refresh start in jiffies, 0 if none
 };
 
 struct gigabyte_wmi {
 	struct device *dev;
 	struct mutex get_lock;
 	struct mutex set_lock;
+	// Held while the governor, a BPF policy or a turbo burst takes over
+	// the boost methods, so that only one of them can own them. Taken
+	// before the lock of the owner.
+	struct mutex boost_lock;
+	struct gb_governor governor;
+	struct gb_turbo turbo;
+	struct gb_power_profiles profiles;
+	struct gb_write_queue writes;
+	struct gb_sampler sampler;
+	struct gb_leds leds;
+	struct gb_snapshot_cache snapshot;
+	// GPU power state last selected with SetNvD1..SetNvD5, 0 if none was
+	// selected since the driver was loaded or the last selection failed
+	// partway. Protected by set_lock.
+	u8 gpu_power_level;
+	struct pmu pmu;
+	int pmu_cpu; // every perf event of the driver runs on this CPU
+	struct hlist_node pmu_node; // moves pmu_cpu when it goes offline
+	bool pmu_registered;
+};
+
+// WMI methods are evaluated on a dedicated worker thread. A caller waits for
+// at most the method's timeout, so a wedged AML method cannot block readers
+// of unrelated attributes forever.
+static unsigned int wmi_timeout_ms = 500;
+module_param(wmi_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(wmi_timeout_ms,
+		 "Time to wait for a WMI call to finish, in milliseconds");
+
+static unsigned int wmi_quarantine_s = 60;
+module_param(wmi_quarantine_s, uint, 0644);
+MODULE_PARM_DESC(wmi_quarantine_s,
+		 "Time a repeatedly hanging WMI method is not called, in seconds");
+
+static unsigned int wmi_stale_ms = 10000;
+module_param(wmi_stale_ms, uint, 0644);
+MODULE_PARM_DESC(
+	wmi_stale_ms,
+	"Maximum age of a cached value returned when a get method times out, in milliseconds");
+
+// Consecutive timeouts after which a method is quarantined.
+#define GB_WMI_STRIKES 3
+
+enum gb_wmi_dir { GB_WMI_GET, GB_WMI_SET, GB_WMI_DIR_COUNT };
+
+static const char *const gb_wmi_guid[GB_WMI_DIR_COUNT] = {
+	[GB_WMI_GET] = GB_GET_GUID,
+	[GB_WMI_SET] = GB_SET_GUID,
+};
+
+// Timeouts of the methods that are known to be slower than the rest, in
+// milliseconds. The battery methods go through the SMBus to the battery.
+// Get and set methods share ids, so the tables are keyed by direction too.
+static const u16 gb_wmi_method_timeout_ms[GB_WMI_DIR_COUNT][GB_METHOD_LAST] = {
+	[GB_WMI_GET] = {
+		[GB_METHOD_BATT_CYC1] = 2000,
+		[GB_METHOD_BATT_CYC] = 2000,
+	},
+	[GB_WMI_SET] = {
+		[GB_METHOD_BATT_COUNT] = 2000,
+		[GB_METHOD_BATTERY_HEALTH] = 2000,
+	},
+};
+
+struct gb_wmi_health {
+	u32 calls;
+	u32 failures;
+	u32 timeouts;
+	u32 strikes; // consecutive timeouts of calls that were started
+	u32 max_us; // slowest finished call, including the time in the queue
+	u32 max_wait_us; // longest time a call waited in its lane
+	unsigned long quarantined_until; // in jiffies, valid if strikes are due
+	// Last result of the get method called without input.
+	u8 cache[8];
+	bool cached;
+	unsigned long cached_at;
+};
+
+// Calls are served from three lanes. Sensor reads go first so that they keep
+// a steady latency, slow battery and inventory queries go last.
+enum gb_wmi_lane {
+	GB_WMI_LANE_NORMAL,
+	GB_WMI_LANE_SENSOR,
+	GB_WMI_LANE_BULK,
+	GB_WMI_LANE_COUNT
+};
+
+static const char *const gb_wmi_lane_name[GB_WMI_LANE_COUNT] = {
+	[GB_WMI_LANE_NORMAL] = "normal",
+	[GB_WMI_LANE_SENSOR] = "sensor",
+	[GB_WMI_LANE_BULK] = "bulk",
+};
+
+// Lanes in the order they are served.
+static const enum gb_wmi_lane gb_wmi_lane_order[] = {
+	GB_WMI_LANE_SENSOR,
+	GB_WMI_LANE_NORMAL,
+	GB_WMI_LANE_BULK,
+};
+
+// Longest time the oldest call of a lane waits before it is served ahead of
+// the lanes with a higher priority, in milliseconds.
+static const unsigned int gb_wmi_lane_max_wait_ms[GB_WMI_LANE_COUNT] = {
+	[GB_WMI_LANE_NORMAL] = 100,
+	[GB_WMI_LANE_BULK] = 1000,
+};
+
+// Methods not listed here are served from the normal lane. The battery
+// count and health are read through their set methods.
+static const u8 gb_wmi_method_lane[GB_WMI_DIR_COUNT][GB_METHOD_LAST] = {
+	[GB_WMI_GET] = {
+		[GB_METHOD_CPU_TEMP] = GB_WMI_LANE_SENSOR,
+		[GB_METHOD_GPU_TEMP1] = GB_WMI_LANE_SENSOR,
+		[GB_METHOD_GPU_TEMP2] = GB_WMI_LANE_SENSOR,
+		[GB_METHOD_RPM1] = GB_WMI_LANE_SENSOR,
+		[GB_METHOD_RPM2] = GB_WMI_LANE_SENSOR,
+		[GB_METHOD_CHECK_HEAVY_LOADING] = GB_WMI_LANE_SENSOR,
+		[GB_METHOD_BATT_CYC1] = GB_WMI_LANE_BULK,
+		[GB_METHOD_BATT_CYC] = GB_WMI_LANE_BULK,
+		[GB_METHOD_POWER_ON_TIME] = GB_WMI_LANE_BULK,
+		[GB_METHOD_FIRST_DATE] = GB_WMI_LANE_BULK,
+	},
+	[GB_WMI_SET] = {
+		[GB_METHOD_BATT_COUNT] = GB_WMI_LANE_BULK,
+		[GB_METHOD_BATTERY_HEALTH] = GB_WMI_LANE_BULK,
+	},
+};
+
+struct gb_wmi_call {
+	struct list_head node;
+	struct completion done;
+	enum gb_wmi_dir dir;
+	u32 method_id;
+	struct acpi_buffer input;
+	struct acpi_buffer output;
+	acpi_status status;
+	ktime_t queued;
+	bool started; // taken off its lane by the dispatcher
+	bool abandoned; // the caller gave up waiting, the worker frees the call
+	u8 in_buf[];
+};
+
+static struct kthread_worker *gb_wmi_worker;
+static struct kthread_work gb_wmi_dispatch_work;
+static struct dentry *gb_debugfs_dir;
+// Protects gb_wmi_health, gb_wmi_lanes, gb_ec_fast, gb_wmi_cpus and the
+// started/abandoned flags of the calls.
+static DEFINE_SPINLOCK(gb_wmi_lock);
+static struct list_head gb_wmi_lanes[GB_WMI_LANE_COUNT];
+
+// CPUs the WMI worker runs on. Unless set with the wmi_cpus parameter, these
+// are the housekeeping CPUs, so the AML interpreter never runs on isolated
+// cores.
+// Readers that cannot sleep take gb_wmi_lock. Updates also hold
+// gb_wmi_cpus_lock until the worker is moved, so the worker always ends up
+// on the mask written last.
+static struct cpumask gb_wmi_cpus;
+static bool gb_wmi_cpus_set;
+static DEFINE_MUTEX(gb_wmi_cpus_lock);
+
+static int gb_wmi_cpus_param_set(const char *val, const struct kernel_param *kp)
+{
+	cpumask_var_t mask;
+	if (!alloc_cpumask_var(&mask, GFP_KERNEL)) {
+		return -ENOMEM;
+	}
+
+	int status = cpulist_parse(val, mask);
+	if (status) {
+		goto out;
+	}
+	if (!cpumask_intersects(mask, cpu_online_mask)) {
+		status = -EINVAL;
+		goto out;
+	}
+
+	mutex_lock(&gb_wmi_cpus_lock);
+	spin_lock(&gb_wmi_lock);
+	cpumask_copy(&gb_wmi_cpus, mask);
+	gb_wmi_cpus_set = true;
+	spin_unlock(&gb_wmi_lock);
+	if (gb_wmi_worker) {
+		status = set_cpus_allowed_ptr(gb_wmi_worker->task, mask);
+	}
+	mutex_unlock(&gb_wmi_cpus_lock);
+
+out:
+	free_cpumask_var(mask);
+	return status;
+}
+
+static int gb_wmi_cpus_param_get(char *buf, const struct kernel_param *kp)
+{
+	mutex_lock(&gb_wmi_cpus_lock);
+	int len = sysfs_emit(buf, "%*pbl\n", cpumask_pr_args(&gb_wmi_cpus));
+	mutex_unlock(&gb_wmi_cpus_lock);
+
+	return len;
+}
+
+static const struct kernel_param_ops gb_wmi_cpus_param_ops = {
+	.set = gb_wmi_cpus_param_set,
+	.get = gb_wmi_cpus_param_get,
+};
+module_param_cb(wmi_cpus, &gb_wmi_cpus_param_ops, NULL, 0644);
+MODULE_PARM_DESC(wmi_cpus,
+		 "CPUs to run WMI methods on, as a CPU list (default: housekeeping CPUs)");
+static struct gb_wmi_health gb_wmi_health[GB_WMI_DIR_COUNT][GB_METHOD_LAST];
+
+// Calls can be recorded into a trace in debugfs, and a recorded trace can be
+// replayed in place of the firmware, on any machine, to reproduce a workload
+// with its original latencies.
+static bool record;
+module_param(record, bool, 0644);
+MODULE_PARM_DESC(record, "Record WMI calls into the debugfs trace");
+
+// Checked when the module loads, before any call is recorded.
+#define GB_TRACE_MAX_RECORDS (1U << 20)
+
+static unsigned int trace_records = 16384;
+module_param(trace_records, uint, 0444);
+MODULE_PARM_DESC(trace_records, "Number of WMI calls the trace can hold");
+
+static bool replay;
+module_param(replay, bool, 0444);
+MODULE_PARM_DESC(
+	replay,
+	"Serve WMI calls from a trace written to debugfs instead of the firmware");
+
+struct gb_trace {
+	spinlock_t lock;
+	struct gb_trace_record *records; // ring of trace_records entries
+	unsigned int head; // next record to write
+	unsigned int count;
+};
+
+static struct gb_trace gb_trace = {
+	.lock = __SPIN_LOCK_UNLOCKED(gb_trace.lock),
+};
+
+struct gb_trace_snapshot {
+	size_t len;
+	u8 data[];
+};
+
+struct gb_replay {
+	struct mutex lock;
+	struct gb_trace_record *records;
+	size_t len; // in bytes
+	// Where to look for the next call of every method. Calls with the same
+	// method and input are served in the order they were recorded.
+	unsigned int pos[GB_WMI_DIR_COUNT][GB_METHOD_LAST];
+};
+
+static struct gb_replay gb_replay = {
+	.lock = __MUTEX_INITIALIZER(gb_replay.lock),
+};
+
+static unsigned int gb_wmi_timeout_ms(enum gb_wmi_dir dir, u32 method_id)
+{
+	unsigned int timeout = gb_wmi_method_timeout_ms[dir][method_id];
+
+	return max(timeout, READ_ONCE(wmi_timeout_ms));
+}
+
+// Called on the worker thread only.
+static void gb_trace_add(const struct gb_wmi_call *call, u64 start,
+			 u64 duration)
+{
+	if (!gb_trace.records) {
+		struct gb_trace_record *records =
+			vzalloc(array_size(trace_records, sizeof(*records)));
+		if (!records) {
+			return;
+		}
+		spin_lock(&gb_trace.lock);
+		gb_trace.records = records;
+		spin_unlock(&gb_trace.lock);
+	}
+
+	struct gb_trace_record rec = {
+		.timestamp_ns = start,
+		.duration_ns = min_t(u64, duration, U32_MAX),
+		.status = call->status,
+		.method_id = call->method_id,
+		.dir = call->dir,
+		.in_len = min_t(size_t, call->input.length, GB_TRACE_DATA_LEN),
+	};
+	memcpy(rec.in, call->in_buf, rec.in_len);
+
+	const union acpi_object *obj = call->output.pointer;
+	if (obj && ACPI_TYPE_INTEGER == obj->type) {
+		__le64 value = cpu_to_le64(obj->integer.value);
+		rec.out_type = ACPI_TYPE_INTEGER;
+		rec.out_len = sizeof(value);
+		memcpy(rec.out, &value, sizeof(value));
+	} else if (obj && ACPI_TYPE_BUFFER == obj->type) {
+		rec.out_type = ACPI_TYPE_BUFFER;
+		rec.out_len = min_t(u32, obj->buffer.length, GB_TRACE_DATA_LEN);
+		memcpy(rec.out, obj->buffer.pointer, rec.out_len);
+	}
+
+	spin_lock(&gb_trace.lock);
+	gb_trace.records[gb_trace.head] = rec;
+	gb_trace.head = (gb_trace.head + 1) % trace_records;
+	if (gb_trace.count < trace_records) {
+		gb_trace.count++;
+	}
+	spin_unlock(&gb_trace.lock);
+}
+
+// Finds the next recorded call of the method with the same input, sleeps for
+// as long as the call took and returns its result.
+static acpi_status gb_replay_evaluate(struct gb_wmi_call *call)
+{
+	const u8 in_len = min_t(size_t, call->input.length, GB_TRACE_DATA_LEN);
+	struct gb_trace_record rec;
+	bool found = false;
+
+	mutex_lock(&gb_replay.lock);
+	const size_t n = gb_replay.len / sizeof(rec);
+	unsigned int *pos = &gb_replay.pos[call->dir][call->method_id];
+	for (size_t i = 0; i < n; ++i) {
+		size_t idx = (*pos + i) % n;
+		const struct gb_trace_record *r = &gb_replay.records[idx];
+		if (r->dir == call->dir && r->method_id == call->method_id &&
+		    r->in_len == in_len && !memcmp(r->in, call->in_buf, in_len)) {
+			rec = *r;
+			*pos = idx + 1;
+			found = true;
+			break;
+		}
+	}
+	mutex_unlock(&gb_replay.lock);
+
+	if (!found) {
+		pr_debug("No recorded call of WMI method %d\n", call->method_id);
+		return AE_NOT_FOUND;
+	}
+
+	fsleep(rec.duration_ns / NSEC_PER_USEC);
+
+	union acpi_object *obj = NULL;
+	if (ACPI_TYPE_INTEGER == rec.out_type) {
+		__le64 value;
+		memcpy(&value, rec.out, sizeof(value));
+		obj = kzalloc(sizeof(*obj), GFP_KERNEL);
+		if (obj) {
+			obj->type = ACPI_TYPE_INTEGER;
+			obj->integer.value = le64_to_cpu(value);
+		}
+	} else if (ACPI_TYPE_BUFFER == rec.out_type) {
+		// The buffer goes in the same allocation, like the ones ACPICA
+		// returns, so the caller frees everything with one kfree().
+		obj = kzalloc(sizeof(*obj) + rec.out_len, GFP_KERNEL);
+		if (obj) {
+			obj->type = ACPI_TYPE_BUFFER;
+			obj->buffer.length = rec.out_len;
+			obj->buffer.pointer = (u8 *)(obj + 1);
+			memcpy(obj->buffer.pointer, rec.out, rec.out_len);
+		}
+	}
+	if (rec.out_type && !obj) {
+		return AE_NO_MEMORY;
+	}
+	call->output.pointer = obj;
+
+	return rec.status;
+}
+
+// Must be called with gb_wmi_lock held.
+static struct gb_wmi_call *gb_wmi_next_call(ktime_t now)
+{
+	struct gb_wmi_call *call;
+
+	// A call that waited too long is served first, so a busy lane cannot
+	// starve the lanes below it.
+	for (int i = 0; i < ARRAY_SIZE(gb_wmi_lane_order); ++i) {
+		enum gb_wmi_lane lane = gb_wmi_lane_order[i];
+		call = list_first_entry_or_null(&gb_wmi_lanes[lane],
+						struct gb_wmi_call, node);
+		if (call && gb_wmi_lane_max_wait_ms[lane] &&
+		    ktime_ms_delta(now, call->queued) >=
+			    gb_wmi_lane_max_wait_ms[lane]) {
+			return call;
+		}
+	}
+
+	for (int i = 0; i < ARRAY_SIZE(gb_wmi_lane_order); ++i) {
+		call = list_first_entry_or_null(
+			&gb_wmi_lanes[gb_wmi_lane_order[i]], struct gb_wmi_call,
+			node);
+		if (call) {
+			return call;
+		}
+	}
+
+	return NULL;
+}
+
+static void gb_wmi_run_call(struct gb_wmi_call *call)
+{
+	u64 start = ktime_get_ns();
+	if (replay) {
+		call->status = gb_replay_evaluate(call);
+	} else {
+		call->status = wmi_evaluate_method(gb_wmi_guid[call->dir], 0,
+						   call->method_id,
+						   &call->input, &call->output);
+	}
+	if (READ_ONCE(record)) {
+		gb_trace_add(call, start, ktime_get_ns() - start);
+	}
+
+	s64 us = ktime_us_delta(ktime_get(), call->queued);
+
+	spin_lock(&gb_wmi_lock);
+	struct gb_wmi_health *health =
+		&gb_wmi_health[call->dir][call->method_id];
+	if (us > health->max_us) {
+		health->max_us = min_t(s64, us, U32_MAX);
+	}
+	bool abandoned = call->abandoned;
+	if (!abandoned) {
+		complete(&call->done);
+	}
+	spin_unlock(&gb_wmi_lock);
+
+	if (abandoned) {
+		kfree(call->output.pointer);
+		kfree(call);
+	}
+}
+
+static void gb_wmi_dispatch(struct kthread_work *work)
+{
+	for (;;) {
+		ktime_t now = ktime_get();
+
+		spin_lock(&gb_wmi_lock);
+		struct gb_wmi_call *call = gb_wmi_next_call(now);
+		if (!call) {
+			spin_unlock(&gb_wmi_lock);
+			break;
+		}
+		list_del(&call->node);
+		call->started = true;
+		struct gb_wmi_health *health =
+			&gb_wmi_health[call->dir][call->method_id];
+		s64 wait = ktime_us_delta(now, call->queued);
+		if (wait > health->max_wait_us) {
+			health->max_wait_us = min_t(s64, wait, U32_MAX);
+		}
+		spin_unlock(&gb_wmi_lock);
+
+		gb_wmi_run_call(call);
+	}
+}
+
+// Evaluates a WMI method on the worker thread. On success the caller owns
+// output->pointer. Returns -ETIMEDOUT when the method did not finish in
+// time or is quarantined.
+static int gb_wmi_evaluate(enum gb_wmi_dir dir, u32 method_id,
+			   const struct acpi_buffer *input,
+			   struct acpi_buffer *output)
+{
+	struct gb_wmi_health *health = &gb_wmi_health[dir][method_id];
+
+	output->pointer = NULL;
+
+	spin_lock(&gb_wmi_lock);
+	bool quarantined = health->strikes >= GB_WMI_STRIKES &&
+			   time_before(jiffies, health->quarantined_until);
+	if (quarantined) {
+		health->calls++;
+		health->timeouts++;
+	}
+	spin_unlock(&gb_wmi_lock);
+	if (quarantined) {
+		return -ETIMEDOUT;
+	}
+
+	struct gb_wmi_call *call =
+		kzalloc(struct_size(call, in_buf, input->length), GFP_KERNEL);
+	if (!call) {
+		return -ENOMEM;
+	}
+	if (input->length) {
+		memcpy(call->in_buf, input->pointer, input->length);
+	}
+	call->dir = dir;
+	call->method_id = method_id;
+	call->input.length = input->length;
+	call->input.pointer = call->in_buf;
+	call->output.length = ACPI_ALLOCATE_BUFFER;
+	init_completion(&call->done);
+	call->queued = ktime_get();
+
+	spin_lock(&gb_wmi_lock);
+	list_add_tail(&call->node,
+		      &gb_wmi_lanes[gb_wmi_method_lane[dir][method_id]]);
+	spin_unlock(&gb_wmi_lock);
+	kthread_queue_work(gb_wmi_worker, &gb_wmi_dispatch_work);
+
+	wait_for_completion_timeout(&call->done,
+				    msecs_to_jiffies(gb_wmi_timeout_ms(dir, method_id)));
+
+	spin_lock(&gb_wmi_lock);
+	health->calls++;
+	if (!completion_done(&call->done)) {
+		health->timeouts++;
+		if (!call->started) {
+			// A call still waiting in its lane is held up by other
+			// methods, it does not count against this one and is
+			// not made at all.
+			list_del(&call->node);
+			spin_unlock(&gb_wmi_lock);
+			kfree(call);
+			return -ETIMEDOUT;
+		}
+		call->abandoned = true;
+		if (++health->strikes >= GB_WMI_STRIKES) {
+			health->quarantined_until =
+				jiffies + READ_ONCE(wmi_quarantine_s) * HZ;
+			if (GB_WMI_STRIKES == health->strikes) {
+				pr_warn("WMI method %d is not responding, quarantined\n",
+					method_id);
+			}
+		}
+		spin_unlock(&gb_wmi_lock);
+		return -ETIMEDOUT;
+	}
+	health->strikes = 0;
+	if (ACPI_FAILURE(call->status)) {
+		health->failures++;
+	}
+	spin_unlock(&gb_wmi_lock);
+
+	*output = call->output;
+	int status = ACPI_FAILURE(call->status) ? -EIO : 0;
+	kfree(call);
+
+	return status;
+}
+
+static int gb_wmi_health_show(struct seq_file *m, void *v)
+{
+	spin_lock(&gb_wmi_lock);
+	for (int dir = 0; dir < GB_WMI_DIR_COUNT; ++dir) {
+		for (u32 id = 0; id < GB_METHOD_LAST; ++id) {
+			const struct gb_wmi_health *health =
+				&gb_wmi_health[dir][id];
+			if (!health->calls) {
+				continue;
+			}
+			bool quarantined =
+				health->strikes >= GB_WMI_STRIKES &&
+				time_before(jiffies, health->quarantined_until);
+			seq_printf(
+				m,
+				"%s %u lane=%s calls=%u failures=%u timeouts=%u max_us=%u max_wait_us=%u timeout_ms=%u quarantined=%d\n",
+				GB_WMI_GET == dir ? "get" : "set", id,
+				gb_wmi_lane_name[gb_wmi_method_lane[dir][id]],
+				health->calls, health->failures,
+				health->timeouts, health->max_us,
+				health->max_wait_us, gb_wmi_timeout_ms(dir, id),
+				quarantined);
+		}
+	}
+	spin_unlock(&gb_wmi_lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(gb_wmi_health);
+
+static int gb_trace_open(struct inode *inode, struct file *file)
+{
+	if (!(file->f_mode & FMODE_READ)) {
+		return 0;
+	}
+
+	// Readers get a copy taken at open time, oldest call first, so the
+	// trace can be read while calls are being recorded.
+	struct gb_trace_snapshot *snap =
+		vmalloc(struct_size(snap, data, array_size(trace_records,
+							   sizeof(struct gb_trace_record))));
+	if (!snap) {
+		return -ENOMEM;
+	}
+
+	struct gb_trace_record *out = (struct gb_trace_record *)snap->data;
+	spin_lock(&gb_trace.lock);
+	unsigned int first = gb_trace.head + trace_records - gb_trace.count;
+	for (unsigned int i = 0; i < gb_trace.count; ++i) {
+		out[i] = gb_trace.records[(first + i) % trace_records];
+	}
+	snap->len = gb_trace.count * sizeof(struct gb_trace_record);
+	spin_unlock(&gb_trace.lock);
+
+	file->private_data = snap;
+
+	return 0;
+}
+
+static ssize_t gb_trace_read(struct file *file, char __user *ubuf,
+			     size_t count, loff_t *ppos)
+{
+	struct gb_trace_snapshot *snap = file->private_data;
+
+	return simple_read_from_buffer(ubuf, count, ppos, snap->data,
+				       snap->len);
+}
+
+// Any write clears the trace.
+static ssize_t gb_trace_write(struct file *file, const char __user *ubuf,
+			      size_t count, loff_t *ppos)
+{
+	spin_lock(&gb_trace.lock);
+	gb_trace.head = 0;
+	gb_trace.count = 0;
+	spin_unlock(&gb_trace.lock);
+
+	return count;
+}
+
+static int gb_trace_release(struct inode *inode, struct file *file)
+{
+	vfree(file->private_data);
+
+	return 0;
+}
+
+static const struct file_operations gb_trace_fops = {
+	.owner = THIS_MODULE,
+	.open = gb_trace_open,
+	.read = gb_trace_read,
+	.write = gb_trace_write,
+	.release = gb_trace_release,
+	.llseek = default_llseek,
+};
+
+// The trace to replay is written as a whole, starting from offset 0.
+static ssize_t gb_replay_write(struct file *file, const char __user *ubuf,
+			       size_t count, loff_t *ppos)
+{
+	mutex_lock(&gb_replay.lock);
+	if (0 == *ppos) {
+		gb_replay.len = 0;
+		memset(gb_replay.pos, 0, sizeof(gb_replay.pos));
+	}
+	ssize_t res = simple_write_to_buffer(
+		gb_replay.records,
+		array_size(trace_records, sizeof(struct gb_trace_record)), ppos,
+		ubuf, count);
+	if (res > 0) {
+		gb_replay.len = max_t(size_t, gb_replay.len, *ppos);
+	} else if (0 == res && count) {
+		res = -ENOSPC;
+	}
+	mutex_unlock(&gb_replay.lock);
+
+	return res;
+}
+
+static const struct file_operations gb_replay_fops = {
+	.owner = THIS_MODULE,
+	.write = gb_replay_write,
+	.llseek = default_llseek,
 };
 
 static int gigabyte_wmi_set(u32 method_id, void *in_buf, size_t in_size,
 			    u32 *out)
 {
 	struct acpi_buffer input = { in_size, in_buf };
-	struct acpi_buffer output = { ACPI_ALLOCATE_BUFFER, NULL };
+	struct acpi_buffer output;
 
-	acpi_status status =
-		wmi_evaluate_method(GB_SET_GUID, 0, method_id, &input, &output);
+	int status = gb_wmi_evaluate(GB_WMI_SET, method_id, &input, &output);
 
 	union acpi_object *obj = output.pointer;
 	if (out && obj && ACPI_TYPE_INTEGER == obj->type) {
@@ -306,7 +1352,34 @@ static int gigabyte_wmi_set(u32 method_id, void *in_buf, size_t in_size,
 		kfree(obj);
 	}
 
-	return ACPI_FAILURE(status) ? -EIO : 0;
+	return status;
+}
+
+static int gb_ec_read_reg(const struct gb_ec_reg *reg, u32 *value)
+{
+	// Multi-byte values are read until two reads agree, so the EC updating
+	// the register in the middle of a read cannot produce a torn value.
+	const struct gb_ec_ops *ops = READ_ONCE(gb_ec_ops);
+	u32 prev = 0;
+	for (int attempt = 0; attempt < 3; ++attempt) {
+		u32 v = 0;
+		for (int i = 0; i < reg->width; ++i) {
+			u8 byte;
+			int status = ops->read(reg->offset + i, &byte);
+			if (status) {
+				return status;
+			}
+			v |= (u32)byte << (8 * i);
+		}
+
+		if (1 == reg->width || (attempt > 0 && v == prev)) {
+			*value = v;
+			return 0;
+		}
+		prev = v;
+	}
+
+	return -EIO;
 }
 
 static int gigabyte_wmi_get(u32 method_id, u8 *in_buf, size_t in_size,
@@ -322,12 +1395,55 @@ static int gigabyte_wmi_get(u32 method_id, u8 *in_buf, size_t in_size,
 		return -EINVAL;
 	}
 
+	// Methods that just return an EC field are served from the EC
+	// directly, skipping the AML interpreter.
+	// An EC transaction busy-waits on the EC, callers on isolated CPUs go
+	// through the worker instead.
+	spin_lock(&gb_wmi_lock);
+	struct gb_ec_reg reg = gb_ec_fast[method_id];
+	bool housekeeping = cpumask_test_cpu(raw_smp_processor_id(),
+					     &gb_wmi_cpus);
+	spin_unlock(&gb_wmi_lock);
+	if (!in_size && reg.width && housekeeping) {
+		u32 value;
+		int status = gb_ec_read_reg(&reg, &value);
+		if (!status) {
+			if (1 == el_size) {
+				*((u8 *)out_buf) = value;
+			} else {
+				*((u16 *)out_buf) = value;
+			}
+			return 0;
+		}
+		pr_debug("EC read for WMI method %d failed: %d\n", method_id,
+			 status);
+	}
+
 	struct acpi_buffer input = { in_size, in_buf };
-	struct acpi_buffer output = { ACPI_ALLOCATE_BUFFER, NULL };
-	acpi_status status =
-		wmi_evaluate_method(GB_GET_GUID, 0, method_id, &input, &output);
-	if (ACPI_FAILURE(status)) {
-		return -EIO;
+	struct acpi_buffer output;
+	struct gb_wmi_health *health = &gb_wmi_health[GB_WMI_GET][method_id];
+	const size_t len = el_count * el_size;
+	void *const out = out_buf;
+	int status = gb_wmi_evaluate(GB_WMI_GET, method_id, &input, &output);
+	if (-ETIMEDOUT == status && !in_size) {
+		// Better a slightly old value than none at all.
+		unsigned long max_age = msecs_to_jiffies(READ_ONCE(wmi_stale_ms));
+		spin_lock(&gb_wmi_lock);
+		bool fresh = health->cached &&
+			     time_before(jiffies, health->cached_at + max_age);
+		if (fresh) {
+			memcpy(out_buf, health->cache, len);
+		}
+		spin_unlock(&gb_wmi_lock);
+		if (fresh) {
+			pr_debug("WMI method %d timed out, using cached value\n",
+				 method_id);
+			return 0;
+		}
+	}
+	if (status) {
+		kfree(output.pointer);
+		return status;
 	}
 
 	union acpi_object *obj = output.pointer;
@@ -338,6 +1454,20 @@ static int gigabyte_wmi_get(u32 method_id, u8 *in_buf, size_t in_size,
 	pr_debug("WMI method %d returned object of type %d\n", method_id,
 		 obj->type);
 
+	if (el_count > 1) {
+		// Methods with several [out] parameters return them packed into
+		// a buffer in the order of declaration.
+		if (ACPI_TYPE_BUFFER != obj->type ||
+		    obj->buffer.length < el_count * el_size) {
+			pr_debug("WMI method %d returned unexpected object\n",
+				 method_id);
+			goto call_err;
+		}
+		memcpy(out_buf, obj->buffer.pointer, el_count * el_size);
+		kfree(output.pointer);
+		goto cache;
+	}
+
 	if (ACPI_TYPE_INTEGER != obj->type) {
 		pr_debug("Unexpected return type: %d\n", obj->type);
 		if (ACPI_TYPE_BUFFER == obj->type) {
@@ -377,6 +1507,15 @@ static int gigabyte_wmi_get(u32 method_id, u8 *in_buf, size_t in_size,
 	}
 
 	kfree(output.pointer);
+
+cache:
+	if (!in_size && len <= sizeof(health->cache)) {
+		spin_lock(&gb_wmi_lock);
+		memcpy(health->cache, out, len);
+		health->cached = true;
+		health->cached_at = jiffies;
+		spin_unlock(&gb_wmi_lock);
+	}
 	return 0;
 
 call_err:
@@ -384,18 +1523,212 @@ call_err:
 	return -EIO;
 }
 
-static ssize_t cpu_fan_duty_show(struct device *dev,
-				 struct device_attribute *attr, char *buf)
+static const struct gb_profile_field *gb_profile_field_find(u32 method_id)
 {
-	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+	for (int i = 0; i < ARRAY_SIZE(gb_profile_fields); ++i) {
+		if (gb_profile_fields[i].method_id == method_id) {
+			return &gb_profile_fields[i];
+		}
+	}
 
-	u8 res;
-	mutex_lock(&wmi->get_lock);
-	int status = gigabyte_wmi_get(GB_METHOD_CPU_FAN_DUTY, NULL, 0, &res,
-				      sizeof(res));
-	mutex_unlock(&wmi->get_lock);
+	return NULL;
+}
 
-	if (status) {
+// Executes the queued writes. Must be called with set_lock held, which lets
+// direct set calls drain the queue first and never overtake a queued write.
+static void gb_write_queue_drain(struct gigabyte_wmi *wmi)
+{
+	struct gb_write_queue *queue = &wmi->writes;
+
+	for (;;) {
+		spin_lock(&queue->lock);
+		struct gb_write_req *req = list_first_entry_or_null(
+			&queue->pending, struct gb_write_req, node);
+		if (req) {
+			list_del(&req->node);
+		}
+		spin_unlock(&queue->lock);
+
+		if (!req) {
+			break;
+		}
+
+		int status = gigabyte_wmi_set(req->method_id, &req->value,
+					      sizeof(req->value), NULL);
+
+		if (status) {
+			pr_warn("Queued write %llu to method %u failed: %d\n",
+				req->seq, req->method_id, status);
+		} else {
+			pr_info("%s(%u)\n",
+				gb_profile_field_find(req->method_id)->wmi_name,
+				req->value);
+		}
+
+		// A request that absorbed later writes stays at the position
+		// of its first one, so writes queued in between may still be
+		// waiting. Everything before the oldest waiting request is
+		// done.
+		spin_lock(&queue->lock);
+		struct gb_write_req *next = list_first_entry_or_null(
+			&queue->pending, struct gb_write_req, node);
+		queue->completed = next ? next->first_seq - 1 :
+					  queue->submitted;
+		if (status) {
+			queue->last_error = status;
+			queue->last_error_seq = req->seq;
+		}
+		spin_unlock(&queue->lock);
+
+		kfree(req);
+
+		sysfs_notify(&wmi->dev->kobj, "async", "completed");
+	}
+}
+
+static void gb_write_queue_work(struct work_struct *work)
+{
+	struct gb_write_queue *queue =
+		container_of(work, struct gb_write_queue, work);
+	struct gigabyte_wmi *wmi =
+		container_of(queue, struct gigabyte_wmi, writes);
+
+	mutex_lock(&wmi->set_lock);
+	gb_write_queue_drain(wmi);
+	mutex_unlock(&wmi->set_lock);
+}
+
+static int gb_write_queue_submit(struct gb_write_queue *queue, u32 method_id,
+				 u32 value)
+{
+	struct gb_write_req *new_req = kzalloc(sizeof(*new_req), GFP_KERNEL);
+	if (!new_req) {
+		return -ENOMEM;
+	}
+	INIT_LIST_HEAD(&new_req->node);
+	new_req->method_id = method_id;
+
+	spin_lock(&queue->lock);
+
+	// A write to a method that is still waiting in the queue replaces the
+	// old value in place, only the latest one reaches the EC and it keeps
+	// its order relative to the writes to other methods.
+	struct gb_write_req *req;
+	struct gb_write_req *found = NULL;
+	list_for_each_entry(req, &queue->pending, node) {
+		if (req->method_id == method_id) {
+			found = req;
+			break;
+		}
+	}
+	if (!found) {
+		found = new_req;
+		new_req = NULL;
+		found->first_seq = queue->submitted + 1;
+		list_add_tail(&found->node, &queue->pending);
+	}
+	found->value = value;
+	found->seq = ++queue->submitted;
+
+	spin_unlock(&queue->lock);
+
+	kfree(new_req);
+	queue_work(system_unbound_wq, &queue->work);
+
+	return 0;
+}
+
+static void gb_write_queue_init(struct gb_write_queue *queue)
+{
+	INIT_WORK(&queue->work, gb_write_queue_work);
+	spin_lock_init(&queue->lock);
+	INIT_LIST_HEAD(&queue->pending);
+}
+
+// Switches to synchronous writes and waits for the queued ones to finish.
+static void gb_write_queue_stop(struct gb_write_queue *queue)
+{
+	WRITE_ONCE(queue->enabled, false);
+	flush_work(&queue->work);
+}
+
+// A running turbo burst restores the settings it changed once it ends, which
+// would undo any other write to them in the meantime. Such a write replaces
+// the saved value instead and takes effect when the burst restores it.
+// Returns true if the value was taken over. Must be called with turbo->lock
+// held.
+static bool gb_turbo_hold(struct gb_turbo *turbo, u32 method_id, u32 value)
+{
+	if (GB_TURBO_IDLE == turbo->phase) {
+		return false;
+	}
+
+	// During the cooldown only the fan settings are still to be restored.
+	int first = GB_TURBO_BOOST == turbo->phase ? 0 : GB_TURBO_FIRST_FAN;
+	for (int i = first; i < GB_TURBO_SETTING_COUNT; ++i) {
+		if (gb_turbo_settings[i].set_id == method_id &&
+		    turbo->saved_valid & BIT(i)) {
+			turbo->saved[i] = value;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Writes a value to a single argument set method of gb_profile_fields. The
+// value is checked against the field's range up front, so a queued write
+// cannot fail on it later. In async mode the write is queued and the function
+// returns right away; it is logged once the EC has taken it.
+static int gigabyte_wmi_write(struct gigabyte_wmi *wmi, u32 method_id,
+			      unsigned long value)
+{
+	const struct gb_profile_field *field = gb_profile_field_find(method_id);
+	if (value > field->max) {
+		return -EINVAL;
+	}
+
+	int status;
+	mutex_lock(&wmi->turbo.lock);
+	if (gb_turbo_hold(&wmi->turbo, method_id, value)) {
+		mutex_unlock(&wmi->turbo.lock);
+		pr_info("%s(%lu) held until the turbo burst ends\n",
+			field->wmi_name, value);
+		return 0;
+	}
+
+	if (READ_ONCE(wmi->writes.enabled)) {
+		status = gb_write_queue_submit(&wmi->writes, method_id, value);
+		mutex_unlock(&wmi->turbo.lock);
+		return status;
+	}
+
+	u32 in_buf = value;
+	mutex_lock(&wmi->set_lock);
+	gb_write_queue_drain(wmi);
+	status = gigabyte_wmi_set(method_id, &in_buf, sizeof(in_buf), NULL);
+	mutex_unlock(&wmi->set_lock);
+	mutex_unlock(&wmi->turbo.lock);
+
+	if (!status) {
+		pr_info("%s(%u)\n", field->wmi_name, in_buf);
+	}
+
+	return status;
+}
+
+static ssize_t cpu_fan_duty_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	u8 res;
+	mutex_lock(&wmi->get_lock);
+	int status = gigabyte_wmi_get(GB_METHOD_CPU_FAN_DUTY, NULL, 0, &res,
+				      sizeof(res));
+	mutex_unlock(&wmi->get_lock);
+
+	if (status) {
 		return status;
 	}
 
@@ -416,18 +1749,12 @@ static ssize_t cpu_fan_duty_store(struct device *dev,
 		return status;
 	}
 
-	u32 in_buf = cpu_fan_duty;
-	mutex_lock(&wmi->set_lock);
-	status = gigabyte_wmi_set(GB_METHOD_CPU_FAN_DUTY, &in_buf,
-				  sizeof(in_buf), NULL);
-	mutex_unlock(&wmi->set_lock);
+	status = gigabyte_wmi_write(wmi, GB_METHOD_CPU_FAN_DUTY, cpu_fan_duty);
 
 	if (status) {
 		return status;
 	}
 
-	pr_info("SetCPUFanDuty(%lu)\n", cpu_fan_duty);
-
 	return count;
 }
 
@@ -463,18 +1790,12 @@ static ssize_t gpu_fan_duty_store(struct device *dev,
 		return status;
 	}
 
-	u32 in_buf = gpu_fan_duty;
-	mutex_lock(&wmi->set_lock);
-	status = gigabyte_wmi_set(GB_METHOD_GPU_FAN_DUTY, &in_buf,
-				  sizeof(in_buf), NULL);
-	mutex_unlock(&wmi->set_lock);
+	status = gigabyte_wmi_write(wmi, GB_METHOD_GPU_FAN_DUTY, gpu_fan_duty);
 
 	if (status) {
 		return status;
 	}
 
-	pr_info("SetGPUFanDuty(%lu)\n", gpu_fan_duty);
-
 	return count;
 }
 
@@ -490,18 +1811,12 @@ static ssize_t current_fan_step_store(struct device *dev,
 		return status;
 	}
 
-	u32 in_buf = step;
-	mutex_lock(&wmi->set_lock);
-	status = gigabyte_wmi_set(GB_METHOD_FAN_STEP, &in_buf, sizeof(in_buf),
-				  NULL);
-	mutex_unlock(&wmi->set_lock);
+	status = gigabyte_wmi_write(wmi, GB_METHOD_FAN_STEP, step);
 
 	if (status) {
 		return status;
 	}
 
-	pr_info("SetCurrentFanStepData(%lu)\n", step);
-
 	return count;
 }
 
@@ -537,18 +1852,13 @@ static ssize_t fixed_fan_status_store(struct device *dev,
 		return status;
 	}
 
-	u32 in_buf = fixed_status;
-	mutex_lock(&wmi->set_lock);
-	status = gigabyte_wmi_set(GB_METHOD_FIXED_FAN_STATUS, &in_buf,
-				  sizeof(in_buf), NULL);
-	mutex_unlock(&wmi->set_lock);
+	status = gigabyte_wmi_write(wmi, GB_METHOD_FIXED_FAN_STATUS,
+				    fixed_status);
 
 	if (status) {
 		return status;
 	}
 
-	pr_info("SetFixedFanStatus(%lu)\n", fixed_status);
-
 	return count;
 }
 
@@ -584,18 +1894,13 @@ static ssize_t fixed_fan_speed_store(struct device *dev,
 		return status;
 	}
 
-	u32 in_buf = fixed_speed;
-	mutex_lock(&wmi->set_lock);
-	status = gigabyte_wmi_set(GB_METHOD_FIXED_FAN_SPEED, &in_buf,
-				  sizeof(in_buf), NULL);
-	mutex_unlock(&wmi->set_lock);
+	status = gigabyte_wmi_write(wmi, GB_METHOD_FIXED_FAN_SPEED,
+				    fixed_speed);
 
 	if (status) {
 		return status;
 	}
 
-	pr_info("SetFanFixedSpeed(%lu)\n", fixed_speed);
-
 	return count;
 }
 
@@ -631,18 +1936,13 @@ static ssize_t step_fan_status_store(struct device *dev,
 		return status;
 	}
 
-	u32 in_buf = step_status;
-	mutex_lock(&wmi->set_lock);
-	status = gigabyte_wmi_set(GB_METHOD_STEP_FAN_STATUS, &in_buf,
-				  sizeof(in_buf), NULL);
-	mutex_unlock(&wmi->set_lock);
+	status = gigabyte_wmi_write(wmi, GB_METHOD_STEP_FAN_STATUS,
+				    step_status);
 
 	if (status) {
 		return status;
 	}
 
-	pr_info("SetStepFanStatus(%lu)\n", step_status);
-
 	return count;
 }
 
@@ -678,17 +1978,237 @@ static ssize_t auto_fan_status_store(struct device *dev,
 		return status;
 	}
 
-	u32 in_buf = fan_status;
+	status = gigabyte_wmi_write(wmi, GB_METHOD_AUTO_FAN_STATUS, fan_status);
+
+	if (status) {
+		return status;
+	}
+
+	return count;
+}
+
+// Checks that the EC register really holds what the WMI method returns. The
+// register is read around the WMI call to tolerate a value changing between
+// the reads, e.g. a fan speeding up.
+static bool gb_ec_verify(const struct gb_ec_reg *reg)
+{
+	const u8 el_count = gb_get_method_out_size[reg->method_id].count;
+	const u8 el_size = gb_get_method_out_size[reg->method_id].size;
+	if (1 != el_count || el_size > 2 || reg->width > el_size) {
+		return false;
+	}
+
+	u32 before, after;
+	if (gb_ec_read_reg(reg, &before)) {
+		return false;
+	}
+
+	u32 value;
+	if (1 == el_size) {
+		u8 v;
+		if (gigabyte_wmi_get(reg->method_id, NULL, 0, &v, sizeof(v))) {
+			return false;
+		}
+		value = v;
+	} else {
+		u16 v;
+		if (gigabyte_wmi_get(reg->method_id, NULL, 0, &v, sizeof(v))) {
+			return false;
+		}
+		value = v;
+	}
+
+	if (gb_ec_read_reg(reg, &after)) {
+		return false;
+	}
+
+	return value >= min(before, after) && value <= max(before, after);
+}
+
+static void gb_ec_enable_reg(const struct gb_ec_reg *reg)
+{
+	if (reg->method_id >= GB_METHOD_LAST || !reg->width) {
+		return;
+	}
+
+	if (!gb_ec_verify(reg)) {
+		pr_warn("EC register 0x%02x does not match WMI method %u, using WMI\n",
+			reg->offset, reg->method_id);
+		return;
+	}
+
+	pr_info("WMI method %u is served from EC register 0x%02x\n",
+		reg->method_id, reg->offset);
+	spin_lock(&gb_wmi_lock);
+	gb_ec_fast[reg->method_id] = *reg;
+	spin_unlock(&gb_wmi_lock);
+}
+
+// Must be called with get_lock held.
+static void gb_ec_setup_fast_path(void)
+{
+	spin_lock(&gb_wmi_lock);
+	memset(gb_ec_fast, 0, sizeof(gb_ec_fast));
+	spin_unlock(&gb_wmi_lock);
+
+	// EC reads are not part of a trace, replay always goes through WMI.
+	if (replay) {
+		return;
+	}
+
+	if (gb_model && gb_model->ec_regs) {
+		for (const struct gb_ec_reg *reg = gb_model->ec_regs;
+		     reg->width; ++reg) {
+			gb_ec_enable_reg(reg);
+		}
+	}
+
+	if (!ec_map) {
+		return;
+	}
+
+	char *str = kstrdup(ec_map, GFP_KERNEL);
+	if (!str) {
+		return;
+	}
+
+	char *cur = str;
+	char *tok;
+	while ((tok = strsep(&cur, ","))) {
+		unsigned int method_id, offset, width;
+		if (3 != sscanf(tok, "%u:%x:%u", &method_id, &offset, &width) ||
+		    offset > U8_MAX || width < 1 || width > 2) {
+			pr_warn("Invalid ec_map entry '%s'\n", tok);
+			continue;
+		}
+
+		struct gb_ec_reg reg = { .method_id = method_id,
+					 .offset = offset,
+					 .width = width };
+		gb_ec_enable_reg(&reg);
+	}
+
+	kfree(str);
+}
+
+int gigabyte_wmi_set_ec_ops(const struct gb_ec_ops *ops)
+{
+	if (!gb_wmi_platform_dev) {
+		return -ENODEV;
+	}
+
+	struct gigabyte_wmi *wmi = platform_get_drvdata(gb_wmi_platform_dev);
+	if (!wmi) {
+		return -ENODEV;
+	}
+
+	mutex_lock(&wmi->get_lock);
+	WRITE_ONCE(gb_ec_ops, ops ? ops : &gb_ec_default_ops);
+	gb_ec_setup_fast_path();
+	mutex_unlock(&wmi->get_lock);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(gigabyte_wmi_set_ec_ops);
+
+#define GB_FAN_CURVE_POINTS 5
+
+// Layout of the GetDeepFan/SetDeepFan arguments: five temperature points
+// followed by the five fan speeds used at those points.
+struct gb_fan_curve {
+	u8 temp[GB_FAN_CURVE_POINTS];
+	u8 speed[GB_FAN_CURVE_POINTS];
+};
+
+static int gigabyte_wmi_get_fan_curve(struct gb_fan_curve *curve)
+{
+	int status = gigabyte_wmi_get(GB_METHOD_DEEP_FAN, NULL, 0, curve,
+				      sizeof(*curve));
+	if (!status) {
+		return 0;
+	}
+
+	// Fall back to reading the curve point by point.
+	for (u32 i = 0; i < GB_FAN_CURVE_POINTS; ++i) {
+		u8 point[2]; // temperature, speed
+		status = gigabyte_wmi_get(GB_METHOD_FAN_INDEX_VALUE, (u8 *)&i,
+					  sizeof(i), point, sizeof(point));
+		if (status) {
+			return status;
+		}
+		curve->temp[i] = point[0];
+		curve->speed[i] = point[1];
+	}
+
+	return 0;
+}
+
+static ssize_t fan_curve_show(struct device *dev, struct device_attribute *attr,
+			      char *buf)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	struct gb_fan_curve curve;
+	mutex_lock(&wmi->get_lock);
+	int status = gigabyte_wmi_get_fan_curve(&curve);
+	mutex_unlock(&wmi->get_lock);
+
+	if (status) {
+		return status;
+	}
+
+	pr_info("GetDeepFan(): %*ph\n", (int)sizeof(curve), &curve);
+
+	int len = 0;
+	for (int i = 0; i < GB_FAN_CURVE_POINTS; ++i) {
+		len += sysfs_emit_at(buf, len, "%d %d\n", curve.temp[i],
+				     curve.speed[i]);
+	}
+
+	return len;
+}
+
+static ssize_t fan_curve_store(struct device *dev,
+			       struct device_attribute *attr, const char *buf,
+			       size_t count)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	// The curve is written as five "temperature speed" pairs.
+	unsigned int temp[GB_FAN_CURVE_POINTS];
+	unsigned int speed[GB_FAN_CURVE_POINTS];
+	int n = sscanf(buf, "%u %u %u %u %u %u %u %u %u %u", &temp[0],
+		       &speed[0], &temp[1], &speed[1], &temp[2], &speed[2],
+		       &temp[3], &speed[3], &temp[4], &speed[4]);
+	if (2 * GB_FAN_CURVE_POINTS != n) {
+		return -EINVAL;
+	}
+
+	struct gb_fan_curve curve;
+	for (int i = 0; i < GB_FAN_CURVE_POINTS; ++i) {
+		if (temp[i] > U8_MAX || speed[i] > U8_MAX) {
+			return -EINVAL;
+		}
+		if (i > 0 && temp[i] < temp[i - 1]) {
+			return -EINVAL;
+		}
+		curve.temp[i] = temp[i];
+		curve.speed[i] = speed[i];
+	}
+
+	// The whole curve goes to the EC in a single call, so the firmware
+	// never runs with a half-updated table.
 	mutex_lock(&wmi->set_lock);
-	status = gigabyte_wmi_set(GB_METHOD_AUTO_FAN_STATUS, &in_buf,
-				  sizeof(in_buf), NULL);
+	gb_write_queue_drain(wmi);
+	int status = gigabyte_wmi_set(GB_METHOD_DEEP_FAN, &curve, sizeof(curve),
+				      NULL);
 	mutex_unlock(&wmi->set_lock);
 
 	if (status) {
 		return status;
 	}
 
-	pr_info("SetAutoFanStatus(%lu)\n", fan_status);
+	pr_info("SetDeepFan(%*ph)\n", (int)sizeof(curve), &curve);
 
 	return count;
 }
@@ -697,13 +2217,10 @@ static ssize_t battery_cycle_count_show(struct device *dev,
 					struct device_attribute *attr,
 					char *buf)
 {
-	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
-
 	u32 res;
-	mutex_lock(&wmi->get_lock);
-	// Because of a bug in the ACPI tables, we must call a set method.
+	// Because of a bug in the ACPI tables, we must call a set method. The
+	// call goes to the bulk lane and does not hold up other readers.
 	int status = gigabyte_wmi_set(GB_METHOD_BATT_COUNT, NULL, 0, &res);
-	mutex_unlock(&wmi->get_lock);
 
 	if (status) {
 		return status;
@@ -717,13 +2234,10 @@ static ssize_t battery_cycle_count_show(struct device *dev,
 static ssize_t battery_health_show(struct device *dev,
 				   struct device_attribute *attr, char *buf)
 {
-	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
-
 	u32 res;
-	mutex_lock(&wmi->get_lock);
-	// Because of a bug in the ACPI tables, we must call a set method.
+	// Because of a bug in the ACPI tables, we must call a set method. The
+	// call goes to the bulk lane and does not hold up other readers.
 	int status = gigabyte_wmi_set(GB_METHOD_BATTERY_HEALTH, NULL, 0, &res);
-	mutex_unlock(&wmi->get_lock);
 
 	if (status) {
 		return status;
@@ -771,18 +2285,12 @@ static ssize_t dynamic_boost_status_store(struct device *dev,
 		return status;
 	}
 
-	u32 in_buf = boost_status;
-	mutex_lock(&wmi->set_lock);
-	status = gigabyte_wmi_set(GB_METHOD_DYNAMIC_BOOST, &in_buf,
-				  sizeof(in_buf), NULL);
-	mutex_unlock(&wmi->set_lock);
+	status = gigabyte_wmi_write(wmi, GB_METHOD_DYNAMIC_BOOST, boost_status);
 
 	if (status) {
 		return status;
 	}
 
-	pr_info("SetDynamicBoostStatus(%lu)\n", boost_status);
-
 	return count;
 }
 
@@ -818,31 +2326,23 @@ static ssize_t whisper_mode_store(struct device *dev,
 		return status;
 	}
 
-	u32 in_buf = whisper_mode;
-	mutex_lock(&wmi->set_lock);
-	status = gigabyte_wmi_set(GB_METHOD_WHISPER_MODE, &in_buf,
-				  sizeof(in_buf), NULL);
-	mutex_unlock(&wmi->set_lock);
+	status = gigabyte_wmi_write(wmi, GB_METHOD_WHISPER_MODE, whisper_mode);
 
 	if (status) {
 		return status;
 	}
 
-	pr_info("SetWhisperMode(%lu)\n", whisper_mode);
-
 	return count;
 }
 
 static ssize_t gpu_temp1_show(struct device *dev, struct device_attribute *attr,
 			      char *buf)
 {
-	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
-
 	u16 res;
-	mutex_lock(&wmi->get_lock);
+	// Sensor reads do not take get_lock, so they never wait for slower
+	// readers.
 	int status = gigabyte_wmi_get(GB_METHOD_GPU_TEMP1, NULL, 0, &res,
 				      sizeof(res));
-	mutex_unlock(&wmi->get_lock);
 
 	if (status) {
 		return status;
@@ -856,13 +2356,11 @@ static ssize_t gpu_temp1_show(struct device *dev, struct device_attribute *attr,
 static ssize_t gpu_temp2_show(struct device *dev, struct device_attribute *attr,
 			      char *buf)
 {
-	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
-
 	u16 res;
-	mutex_lock(&wmi->get_lock);
+	// Sensor reads do not take get_lock, so they never wait for slower
+	// readers.
 	int status = gigabyte_wmi_get(GB_METHOD_GPU_TEMP2, NULL, 0, &res,
 				      sizeof(res));
-	mutex_unlock(&wmi->get_lock);
 
 	if (status) {
 		return status;
@@ -905,18 +2403,12 @@ static ssize_t nv_power_config_store(struct device *dev,
 		return status;
 	}
 
-	u32 in_buf = pwr_cfg;
-	mutex_lock(&wmi->set_lock);
-	status = gigabyte_wmi_set(GB_METHOD_NV_POWER_CONFIG, &in_buf,
-				  sizeof(in_buf), NULL);
-	mutex_unlock(&wmi->set_lock);
+	status = gigabyte_wmi_write(wmi, GB_METHOD_NV_POWER_CONFIG, pwr_cfg);
 
 	if (status) {
 		return status;
 	}
 
-	pr_info("SetNvPowerConfig(%lu)\n", pwr_cfg);
-
 	return count;
 }
 
@@ -952,61 +2444,2627 @@ static ssize_t nv_thermal_target_store(struct device *dev,
 		return status;
 	}
 
-	u32 in_buf = therm_tgt;
-	mutex_lock(&wmi->set_lock);
-	status = gigabyte_wmi_set(GB_METHOD_NV_THERMAL_TARGET, &in_buf,
-				  sizeof(in_buf), NULL);
-	mutex_unlock(&wmi->set_lock);
+	status = gigabyte_wmi_write(wmi, GB_METHOD_NV_THERMAL_TARGET,
+				    therm_tgt);
 
 	if (status) {
 		return status;
 	}
 
-	pr_info("SetNvThermalTarget(%lu)\n", therm_tgt);
-
 	return count;
 }
 
-static DEVICE_ATTR_RW(cpu_fan_duty);
-static DEVICE_ATTR_RW(gpu_fan_duty);
-static DEVICE_ATTR_WO(current_fan_step);
-static DEVICE_ATTR_RW(fixed_fan_status);
-static DEVICE_ATTR_RW(step_fan_status);
-static DEVICE_ATTR_RW(fixed_fan_speed);
-static DEVICE_ATTR_RW(auto_fan_status);
+#define GB_GPU_POWER_LEVELS 5
 
-static struct attribute *fan_control_attrs[] = {
-	&dev_attr_cpu_fan_duty.attr,	 &dev_attr_gpu_fan_duty.attr,
-	&dev_attr_current_fan_step.attr, &dev_attr_fixed_fan_status.attr,
-	&dev_attr_fixed_fan_speed.attr,	 &dev_attr_step_fan_status.attr,
-	&dev_attr_auto_fan_status.attr,	 NULL,
-};
+// Selects one power state. Each state has its own method and flag, and the
+// firmware is not known to clear the others when one is set, so they are
+// cleared explicitly. A failure partway can leave several flags set, so the
+// level is then reported as unknown. Must be called with set_lock held.
+static int gb_gpu_set_power_level(struct gigabyte_wmi *wmi, u8 level)
+{
+	int status = 0;
 
-static const struct attribute_group fan_control_attribute_group = {
-	.name = "fan_control",
-	.attrs = fan_control_attrs,
-};
+	for (u8 i = 1; i <= GB_GPU_POWER_LEVELS && !status; ++i) {
+		if (i == level) {
+			continue;
+		}
 
-static DEVICE_ATTR_RO(battery_cycle_count);
-static DEVICE_ATTR_RO(battery_health);
+		u32 disable = 0;
+		status = gigabyte_wmi_set(GB_METHOD_NV_D1 + i - 1, &disable,
+					  sizeof(disable), NULL);
+	}
 
-static struct attribute *battery_attrs[] = {
-	&dev_attr_battery_cycle_count.attr,
-	&dev_attr_battery_health.attr,
-	NULL,
-};
+	if (!status) {
+		u32 enable = 1;
+		status = gigabyte_wmi_set(GB_METHOD_NV_D1 + level - 1, &enable,
+					  sizeof(enable), NULL);
+	}
 
-static const struct attribute_group battery_attribute_group = {
-	.name = "battery",
-	.attrs = battery_attrs,
-};
+	wmi->gpu_power_level = status ? 0 : level;
 
-static DEVICE_ATTR_RW(dynamic_boost_status);
-static DEVICE_ATTR_RW(whisper_mode);
+	return status;
+}
 
-static struct attribute *performance_attrs[] = {
-	&dev_attr_dynamic_boost_status.attr, &dev_attr_whisper_mode.attr, NULL
-};
+static ssize_t power_level_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	// The firmware has no getter for the power state, report the one set
+	// last.
+	mutex_lock(&wmi->set_lock);
+	u8 level = wmi->gpu_power_level;
+	mutex_unlock(&wmi->set_lock);
+
+	return sysfs_emit(buf, "%d\n", level);
+}
+
+static ssize_t power_level_store(struct device *dev,
+				 struct device_attribute *attr, const char *buf,
+				 size_t count)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	unsigned int level;
+	unsigned int therm_tgt;
+	int n = sscanf(buf, "%u %u", &level, &therm_tgt);
+	if (n < 1 || level < 1 || level > GB_GPU_POWER_LEVELS) {
+		return -EINVAL;
+	}
+	if (2 == n && therm_tgt > U8_MAX) {
+		return -EINVAL;
+	}
+
+	// The power state and the thermal target are changed under one
+	// set_lock hold, so no other write can land between them.
+	mutex_lock(&wmi->set_lock);
+	gb_write_queue_drain(wmi);
+	u8 prev = wmi->gpu_power_level;
+	int status = gb_gpu_set_power_level(wmi, level);
+	if (!status && 2 == n) {
+		u32 in_buf = therm_tgt;
+		status = gigabyte_wmi_set(GB_METHOD_NV_THERMAL_TARGET, &in_buf,
+					  sizeof(in_buf), NULL);
+		// Do not leave the new power state behind with the old thermal
+		// target. Without a previous level to go back to, the state is
+		// unknown.
+		if (status) {
+			if (prev) {
+				gb_gpu_set_power_level(wmi, prev);
+			} else {
+				wmi->gpu_power_level = 0;
+			}
+		}
+	}
+	mutex_unlock(&wmi->set_lock);
+
+	if (status) {
+		return status;
+	}
+
+	if (2 == n) {
+		pr_info("SetNvD%u(1), SetNvThermalTarget(%u)\n", level,
+			therm_tgt);
+	} else {
+		pr_info("SetNvD%u(1)\n", level);
+	}
+
+	return count;
+}
+
+static void gb_governor_cpu_times(u64 *idle, u64 *wall)
+{
+	int cpu;
+
+	*idle = 0;
+	*wall = 0;
+	for_each_online_cpu(cpu) {
+		u64 cpu_wall;
+		u64 cpu_idle = get_cpu_idle_time_us(cpu, &cpu_wall);
+		if (-1ULL == cpu_idle) {
+			// NOHZ idle accounting is not active, use tick statistics.
+			cpu_idle = div_u64(kcpustat_cpu(cpu).cpustat[CPUTIME_IDLE],
+					   NSEC_PER_USEC);
+			cpu_wall = ktime_to_us(ktime_get());
+		}
+		*idle += cpu_idle;
+		*wall += cpu_wall;
+	}
+}
+
+static int gb_governor_apply(struct gigabyte_wmi *wmi, bool boost)
+{
+	u32 whisper = !boost;
+	u32 on = boost;
+
+	mutex_lock(&wmi->set_lock);
+	gb_write_queue_drain(wmi);
+	int status = gigabyte_wmi_set(GB_METHOD_WHISPER_MODE, &whisper,
+				      sizeof(whisper), NULL);
+	if (!status) {
+		status = gigabyte_wmi_set(GB_METHOD_DYNAMIC_BOOST, &on,
+					  sizeof(on), NULL);
+	}
+	if (!status) {
+		status = gigabyte_wmi_set(GB_METHOD_AI_BOOST_STATUS, &on,
+					  sizeof(on), NULL);
+	}
+	mutex_unlock(&wmi->set_lock);
+
+	return status;
+}
+
+static void gb_governor_work(struct work_struct *work)
+{
+	struct gb_governor *gov =
+		container_of(to_delayed_work(work), struct gb_governor, work);
+	struct gigabyte_wmi *wmi =
+		container_of(gov, struct gigabyte_wmi, governor);
+
+	u8 heavy;
+	int status = gigabyte_wmi_get(GB_METHOD_CHECK_HEAVY_LOADING, NULL, 0,
+				      &heavy, sizeof(heavy));
+
+	if (status) {
+		heavy = 0;
+	}
+
+	mutex_lock(&gov->lock);
+
+	u64 idle, wall;
+	gb_governor_cpu_times(&idle, &wall);
+	u64 idle_delta = idle - gov->prev_idle;
+	u64 wall_delta = wall - gov->prev_wall;
+	gov->prev_idle = idle;
+	gov->prev_wall = wall;
+
+	gov->load = 0;
+	if (wall_delta > idle_delta) {
+		gov->load = div64_u64(100 * (wall_delta - idle_delta),
+				      wall_delta);
+	}
+	gov->heavy = heavy;
+
+	bool boost;
+	if (!gov->valid) {
+		boost = heavy || gov->load >= gov->up_threshold;
+	} else if (gov->boosted) {
+		boost = heavy || gov->load > gov->down_threshold;
+	} else {
+		boost = heavy || gov->load >= gov->up_threshold;
+	}
+
+	unsigned long dwell = msecs_to_jiffies(gov->boosted ?
+						       gov->boost_dwell_ms :
+						       gov->quiet_dwell_ms);
+	bool settled = time_after_eq(jiffies, gov->switched + dwell);
+
+	if (!gov->valid || (boost != gov->boosted && settled)) {
+		status = gb_governor_apply(wmi, boost);
+		if (status) {
+			pr_warn("Governor failed to switch to %s: %d\n",
+				boost ? "boost" : "quiet", status);
+			gov->valid = false;
+		} else {
+			pr_debug("Governor switched to %s, load %u%%, heavy %d\n",
+				 boost ? "boost" : "quiet", gov->load, heavy);
+			gov->valid = true;
+			gov->boosted = boost;
+			gov->switched = jiffies;
+		}
+	}
+
+	if (gov->enabled) {
+		queue_delayed_work(system_unbound_wq, &gov->work,
+				   msecs_to_jiffies(gov->period_ms));
+	}
+
+	mutex_unlock(&gov->lock);
+}
+
+static void gb_governor_init(struct gb_governor *gov)
+{
+	mutex_init(&gov->lock);
+	INIT_DELAYED_WORK(&gov->work, gb_governor_work);
+	gov->period_ms = 1000;
+	gov->up_threshold = 60;
+	gov->down_threshold = 20;
+	gov->boost_dwell_ms = 10000;
+	gov->quiet_dwell_ms = 0;
+}
+
+static void gb_governor_stop(struct gb_governor *gov)
+{
+	mutex_lock(&gov->lock);
+	gov->enabled = false;
+	mutex_unlock(&gov->lock);
+
+	cancel_delayed_work_sync(&gov->work);
+}
+
+static ssize_t governor_enabled_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%d\n", READ_ONCE(wmi->governor.enabled));
+}
+
+static ssize_t governor_enabled_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+	struct gb_governor *gov = &wmi->governor;
+
+	bool enable;
+	int status = kstrtobool(buf, &enable);
+	if (status) {
+		return status;
+	}
+
+	if (!enable) {
+		gb_governor_stop(gov);
+		pr_info("Governor disabled\n");
+		return count;
+	}
+
+	// An attached BPF policy or a turbo burst owns the boost methods.
+	mutex_lock(&wmi->boost_lock);
+	if (rcu_access_pointer(gb_policy) ||
+	    GB_TURBO_IDLE != READ_ONCE(wmi->turbo.phase)) {
+		mutex_unlock(&wmi->boost_lock);
+		return -EBUSY;
+	}
+
+	mutex_lock(&gov->lock);
+	if (!gov->enabled) {
+		gov->enabled = true;
+		gov->valid = false;
+		gb_governor_cpu_times(&gov->prev_idle, &gov->prev_wall);
+		queue_delayed_work(system_unbound_wq, &gov->work,
+				   msecs_to_jiffies(gov->period_ms));
+	}
+	mutex_unlock(&gov->lock);
+	mutex_unlock(&wmi->boost_lock);
+
+	pr_info("Governor enabled\n");
+
+	return count;
+}
+
+static ssize_t governor_state_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+	struct gb_governor *gov = &wmi->governor;
+
+	mutex_lock(&gov->lock);
+	const char *state = !gov->enabled ? "off" :
+			    !gov->valid	  ? "unknown" :
+			    gov->boosted  ? "boost" :
+					    "quiet";
+	int len = sysfs_emit(buf, "%s load=%u heavy=%d\n", state, gov->load,
+			     gov->heavy);
+	mutex_unlock(&gov->lock);
+
+	return len;
+}
+
+#define GB_GOVERNOR_ATTR(_name, _min, _max)                                    \
+	static ssize_t governor_##_name##_show(                                \
+		struct device *dev, struct device_attribute *attr, char *buf)  \
+	{                                                                      \
+		struct gigabyte_wmi *wmi = dev_get_drvdata(dev);               \
+		return sysfs_emit(buf, "%u\n",                                 \
+				  READ_ONCE(wmi->governor._name));             \
+	}                                                                      \
+	static ssize_t governor_##_name##_store(struct device *dev,            \
+						struct device_attribute *attr, \
+						const char *buf, size_t count) \
+	{                                                                      \
+		struct gigabyte_wmi *wmi = dev_get_drvdata(dev);               \
+		unsigned int val;                                              \
+		int status = kstrtouint(buf, 10, &val);                        \
+		if (status) {                                                  \
+			return status;                                         \
+		}                                                              \
+		if (val < (_min) || val > (_max)) {                            \
+			return -EINVAL;                                        \
+		}                                                              \
+		mutex_lock(&wmi->governor.lock);                               \
+		wmi->governor._name = val;                                     \
+		mutex_unlock(&wmi->governor.lock);                             \
+		return count;                                                  \
+	}                                                                      \
+	static struct device_attribute dev_attr_governor_##_name = __ATTR(     \
+		_name, 0644, governor_##_name##_show, governor_##_name##_store)
+
+GB_GOVERNOR_ATTR(period_ms, 100, 60000);
+GB_GOVERNOR_ATTR(up_threshold, 0, 100);
+GB_GOVERNOR_ATTR(down_threshold, 0, 100);
+GB_GOVERNOR_ATTR(boost_dwell_ms, 0, 600000);
+GB_GOVERNOR_ATTR(quiet_dwell_ms, 0, 600000);
+
+// Used when the firmware does not report a GPU thermal target.
+#define GB_TURBO_GPU_LIMIT 87
+// The fans are released early once both temperatures are this far below
+// their limits.
+#define GB_TURBO_COOL_MARGIN 10
+#define GB_TURBO_PERIOD_MS 1000
+
+static bool gb_turbo_burst_value(const struct gb_turbo *turbo, int setting,
+				 u32 *value)
+{
+	switch (setting) {
+	case GB_TURBO_SMART_LEVEL:
+		*value = turbo->smart_turbo_level;
+		return 0 != turbo->smart_turbo_level;
+	case GB_TURBO_AUTO_FAN:
+		*value = 0;
+		return true;
+	case GB_TURBO_FIXED_FAN_SPEED:
+	case GB_TURBO_GPU_FAN_DUTY:
+		*value = turbo->fan_duty;
+		return true;
+	default:
+		*value = 1;
+		return true;
+	}
+}
+
+// Remembers the current settings so the burst can be undone. Must be called
+// with turbo->lock held, which keeps new writes from being queued, so the
+// queued ones land before the settings are read.
+static void gb_turbo_save(struct gigabyte_wmi *wmi, struct gb_turbo *turbo)
+{
+	turbo->saved_valid = 0;
+
+	mutex_lock(&wmi->set_lock);
+	gb_write_queue_drain(wmi);
+	mutex_unlock(&wmi->set_lock);
+
+	mutex_lock(&wmi->get_lock);
+	for (int i = 0; i < GB_TURBO_SETTING_COUNT; ++i) {
+		u32 value = 0;
+		if (gigabyte_wmi_get(gb_turbo_settings[i].get_id, NULL, 0,
+				     &value, sizeof(value))) {
+			continue;
+		}
+		// There is a bug in the ACPI tables, see
+		// dynamic_boost_status_show(). The saved value is restored
+		// with the set method, so it is inverted back.
+		if (GB_TURBO_DYNAMIC_BOOST == i) {
+			value = (0 == value);
+		}
+		turbo->saved[i] = value;
+		turbo->saved_valid |= BIT(i);
+	}
+	mutex_unlock(&wmi->get_lock);
+}
+
+// Applies the burst values of the settings in [first, last), or restores the
+// saved ones in reverse order. Restoring goes on past a failed setting.
+static int gb_turbo_apply(struct gigabyte_wmi *wmi, struct gb_turbo *turbo,
+			  int first, int last, bool burst)
+{
+	int err = 0;
+
+	mutex_lock(&wmi->set_lock);
+	gb_write_queue_drain(wmi);
+	for (int n = first; n < last; ++n) {
+		int i = burst ? n : first + last - 1 - n;
+
+		u32 value;
+		if (burst) {
+			if (!gb_turbo_burst_value(turbo, i, &value)) {
+				continue;
+			}
+		} else {
+			if (!(turbo->saved_valid & BIT(i))) {
+				continue;
+			}
+			value = turbo->saved[i];
+		}
+
+		int status = gigabyte_wmi_set(gb_turbo_settings[i].set_id,
+					      &value, sizeof(value), NULL);
+		if (status) {
+			err = err ? err : status;
+			if (burst) {
+				break;
+			}
+		}
+	}
+	mutex_unlock(&wmi->set_lock);
+
+	return err;
+}
+
+// Must be called with turbo->lock held. Drops the performance settings and
+// keeps the fans up until the machine cools down.
+static void gb_turbo_end(struct gigabyte_wmi *wmi, struct gb_turbo *turbo,
+			 const char *why)
+{
+	gb_turbo_apply(wmi, turbo, 0, GB_TURBO_FIRST_FAN, false);
+	turbo->phase = GB_TURBO_COOLDOWN;
+	turbo->ended = why;
+	turbo->deadline_ns = ktime_get_boottime_ns() +
+			     (u64)turbo->cooldown_s * NSEC_PER_SEC;
+
+	pr_info("Turbo burst ended (%s), cooling down\n", why);
+}
+
+// Must be called with turbo->lock held.
+static void gb_turbo_finish(struct gigabyte_wmi *wmi, struct gb_turbo *turbo)
+{
+	gb_turbo_apply(wmi, turbo, GB_TURBO_FIRST_FAN, GB_TURBO_SETTING_COUNT,
+		       false);
+	turbo->phase = GB_TURBO_IDLE;
+
+	pr_info("Turbo cooldown finished\n");
+}
+
+static int gb_turbo_read_temp(u32 method_id)
+{
+	u16 temp;
+	if (gigabyte_wmi_get(method_id, NULL, 0, &temp, sizeof(temp))) {
+		return -1;
+	}
+
+	return temp;
+}
+
+static void gb_turbo_work(struct work_struct *work)
+{
+	struct gb_turbo *turbo =
+		container_of(to_delayed_work(work), struct gb_turbo, work);
+	struct gigabyte_wmi *wmi =
+		container_of(turbo, struct gigabyte_wmi, turbo);
+
+	int cpu = gb_turbo_read_temp(GB_METHOD_CPU_TEMP);
+	int gpu = max(gb_turbo_read_temp(GB_METHOD_GPU_TEMP1),
+		      gb_turbo_read_temp(GB_METHOD_GPU_TEMP2));
+
+	mutex_lock(&turbo->lock);
+
+	u64 now = ktime_get_boottime_ns();
+	u64 elapsed_ms = div_u64(now - turbo->last_ns, NSEC_PER_MSEC);
+	turbo->last_ns = now;
+
+	// A sensor that cannot be read counts as cool.
+	int cpu_over = cpu >= 0 ? cpu - (int)turbo->cpu_limit :
+				  -GB_TURBO_COOL_MARGIN;
+	int gpu_over = gpu >= 0 ? gpu - (int)turbo->gpu_limit :
+				  -GB_TURBO_COOL_MARGIN;
+
+	switch (turbo->phase) {
+	case GB_TURBO_BOOST:
+		turbo->heat += (u64)(max(cpu_over, 0) + max(gpu_over, 0)) *
+			       elapsed_ms;
+		if (turbo->heat >= (u64)turbo->budget * MSEC_PER_SEC) {
+			gb_turbo_end(wmi, turbo, "budget");
+		} else if (now >= turbo->deadline_ns) {
+			gb_turbo_end(wmi, turbo, "expired");
+		}
+		break;
+	case GB_TURBO_COOLDOWN:
+		if ((cpu_over <= -GB_TURBO_COOL_MARGIN &&
+		     gpu_over <= -GB_TURBO_COOL_MARGIN) ||
+		    now >= turbo->deadline_ns) {
+			gb_turbo_finish(wmi, turbo);
+		}
+		break;
+	case GB_TURBO_IDLE:
+		break;
+	}
+
+	if (GB_TURBO_IDLE != turbo->phase) {
+		queue_delayed_work(system_unbound_wq, &turbo->work,
+				   msecs_to_jiffies(GB_TURBO_PERIOD_MS));
+	}
+	mutex_unlock(&turbo->lock);
+}
+
+static void gb_turbo_init(struct gb_turbo *turbo)
+{
+	mutex_init(&turbo->lock);
+	INIT_DELAYED_WORK(&turbo->work, gb_turbo_work);
+	turbo->budget = 300;
+	turbo->cpu_limit = 90;
+	turbo->fan_duty = 229;
+	turbo->cooldown_s = 60;
+	turbo->ended = "none";
+}
+
+// Puts back every setting a running burst changed.
+static void gb_turbo_stop(struct gigabyte_wmi *wmi, struct gb_turbo *turbo)
+{
+	mutex_lock(&turbo->lock);
+	if (GB_TURBO_BOOST == turbo->phase) {
+		gb_turbo_apply(wmi, turbo, 0, GB_TURBO_FIRST_FAN, false);
+	}
+	if (GB_TURBO_IDLE != turbo->phase) {
+		gb_turbo_apply(wmi, turbo, GB_TURBO_FIRST_FAN,
+			       GB_TURBO_SETTING_COUNT, false);
+		turbo->phase = GB_TURBO_IDLE;
+	}
+	mutex_unlock(&turbo->lock);
+
+	cancel_delayed_work_sync(&turbo->work);
+}
+
+// Accepts "seconds [budget]". A new request replaces a running burst, 0
+// ends it.
+static ssize_t turbo_request_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+	struct gb_turbo *turbo = &wmi->turbo;
+
+	unsigned int seconds;
+	unsigned int budget = READ_ONCE(turbo->budget);
+	int n = sscanf(buf, "%u %u", &seconds, &budget);
+	if (n < 1 || seconds > 86400 || !budget) {
+		return -EINVAL;
+	}
+
+	if (!seconds) {
+		mutex_lock(&turbo->lock);
+		if (GB_TURBO_BOOST == turbo->phase) {
+			gb_turbo_end(wmi, turbo, "cancelled");
+		}
+		mutex_unlock(&turbo->lock);
+		return count;
+	}
+
+	// The governor and a BPF policy write the same boost methods.
+	mutex_lock(&wmi->boost_lock);
+	if (READ_ONCE(wmi->governor.enabled) ||
+	    rcu_access_pointer(gb_policy)) {
+		mutex_unlock(&wmi->boost_lock);
+		return -EBUSY;
+	}
+
+	mutex_lock(&turbo->lock);
+
+	if (GB_TURBO_IDLE == turbo->phase) {
+		gb_turbo_save(wmi, turbo);
+	}
+
+	u8 target;
+	mutex_lock(&wmi->get_lock);
+	int status = gigabyte_wmi_get(GB_METHOD_NV_THERMAL_TARGET, NULL, 0,
+				      &target, sizeof(target));
+	mutex_unlock(&wmi->get_lock);
+	turbo->gpu_limit = !status && target ? target : GB_TURBO_GPU_LIMIT;
+
+	status = gb_turbo_apply(wmi, turbo, 0, GB_TURBO_SETTING_COUNT, true);
+	if (status) {
+		gb_turbo_apply(wmi, turbo, 0, GB_TURBO_SETTING_COUNT, false);
+		turbo->phase = GB_TURBO_IDLE;
+		turbo->ended = "error";
+		mutex_unlock(&turbo->lock);
+		mutex_unlock(&wmi->boost_lock);
+		return status;
+	}
+
+	bool running = GB_TURBO_IDLE != turbo->phase;
+	turbo->phase = GB_TURBO_BOOST;
+	turbo->budget = budget;
+	turbo->heat = 0;
+	turbo->last_ns = ktime_get_boottime_ns();
+	turbo->deadline_ns = turbo->last_ns + (u64)seconds * NSEC_PER_SEC;
+	if (!running) {
+		queue_delayed_work(system_unbound_wq, &turbo->work,
+				   msecs_to_jiffies(GB_TURBO_PERIOD_MS));
+	}
+	mutex_unlock(&turbo->lock);
+	mutex_unlock(&wmi->boost_lock);
+
+	pr_info("Turbo burst for %us, budget %u degree seconds\n", seconds,
+		budget);
+
+	return count;
+}
+
+static ssize_t turbo_state_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+	struct gb_turbo *turbo = &wmi->turbo;
+
+	static const char *const phases[] = {
+		[GB_TURBO_IDLE] = "idle",
+		[GB_TURBO_BOOST] = "boost",
+		[GB_TURBO_COOLDOWN] = "cooldown",
+	};
+
+	mutex_lock(&turbo->lock);
+	u64 now = ktime_get_boottime_ns();
+	u64 remaining = GB_TURBO_IDLE != turbo->phase &&
+					turbo->deadline_ns > now ?
+				turbo->deadline_ns - now :
+				0;
+	int len = sysfs_emit(buf,
+			     "phase=%s\nremaining_ms=%llu\nheat=%llu\n"
+			     "budget=%u\ngpu_limit=%u\nlast_end=%s\n",
+			     phases[turbo->phase],
+			     div_u64(remaining, NSEC_PER_MSEC),
+			     div_u64(turbo->heat, MSEC_PER_SEC), turbo->budget,
+			     turbo->gpu_limit, turbo->ended);
+	mutex_unlock(&turbo->lock);
+
+	return len;
+}
+
+#define GB_TURBO_ATTR(_name, _min, _max)                                       \
+	static ssize_t turbo_##_name##_show(                                   \
+		struct device *dev, struct device_attribute *attr, char *buf)  \
+	{                                                                      \
+		struct gigabyte_wmi *wmi = dev_get_drvdata(dev);               \
+		return sysfs_emit(buf, "%u\n", READ_ONCE(wmi->turbo._name));   \
+	}                                                                      \
+	static ssize_t turbo_##_name##_store(struct device *dev,               \
+					     struct device_attribute *attr,    \
+					     const char *buf, size_t count)    \
+	{                                                                      \
+		struct gigabyte_wmi *wmi = dev_get_drvdata(dev);               \
+		unsigned int val;                                              \
+		int status = kstrtouint(buf, 10, &val);                        \
+		if (status) {                                                  \
+			return status;                                         \
+		}                                                              \
+		if (val < (_min) || val > (_max)) {                            \
+			return -EINVAL;                                        \
+		}                                                              \
+		mutex_lock(&wmi->turbo.lock);                                  \
+		wmi->turbo._name = val;                                        \
+		mutex_unlock(&wmi->turbo.lock);                                \
+		return count;                                                  \
+	}                                                                      \
+	static struct device_attribute dev_attr_turbo_##_name = __ATTR(        \
+		_name, 0644, turbo_##_name##_show, turbo_##_name##_store)
+
+GB_TURBO_ATTR(budget, 1, 1000000);
+GB_TURBO_ATTR(cpu_limit, 40, 110);
+GB_TURBO_ATTR(fan_duty, 0, U8_MAX);
+GB_TURBO_ATTR(cooldown_s, 0, 3600);
+GB_TURBO_ATTR(smart_turbo_level, 0, U8_MAX);
+
+static int gb_profile_parse(const char *buf, struct gb_profile *profile)
+{
+	char *str = kstrdup(buf, GFP_KERNEL);
+	if (!str) {
+		return -ENOMEM;
+	}
+
+	memset(profile, 0, sizeof(*profile));
+
+	// The profile is a whitespace or comma separated list of "name=value"
+	// pairs. Commas save quoting on the kernel command line.
+	int status = 0;
+	char *cur = str;
+	char *tok;
+	while ((tok = strsep(&cur, " \t\n,"))) {
+		if (!*tok) {
+			continue;
+		}
+
+		char *val = strchr(tok, '=');
+		if (!val) {
+			status = -EINVAL;
+			break;
+		}
+		*val++ = '\0';
+
+		int i;
+		for (i = 0; i < ARRAY_SIZE(gb_profile_fields); ++i) {
+			if (0 == strcmp(tok, gb_profile_fields[i].name)) {
+				break;
+			}
+		}
+		if (ARRAY_SIZE(gb_profile_fields) == i) {
+			status = -EINVAL;
+			break;
+		}
+
+		u32 v;
+		status = kstrtou32(val, 10, &v);
+		if (status) {
+			break;
+		}
+		if (v > gb_profile_fields[i].max) {
+			status = -EINVAL;
+			break;
+		}
+
+		profile->value[i] = v;
+		profile->mask |= BIT(i);
+	}
+
+	kfree(str);
+	return status;
+}
+
+static ssize_t gb_profile_emit(const struct gb_profile *profile, char *buf)
+{
+	int len = 0;
+	for (int i = 0; i < ARRAY_SIZE(gb_profile_fields); ++i) {
+		if (profile->mask & BIT(i)) {
+			len += sysfs_emit_at(buf, len, "%s%s=%u", len ? " " : "",
+					     gb_profile_fields[i].name,
+					     profile->value[i]);
+		}
+	}
+	len += sysfs_emit_at(buf, len, "\n");
+
+	return len;
+}
+
+// Writes all settings of the profile as one batch, no other writer can
+// interleave with it.
+static int gb_profile_apply(struct gigabyte_wmi *wmi,
+			    const struct gb_profile *profile)
+{
+	int status = 0;
+
+	mutex_lock(&wmi->turbo.lock);
+	mutex_lock(&wmi->set_lock);
+	gb_write_queue_drain(wmi);
+	for (int i = 0; i < ARRAY_SIZE(gb_profile_fields); ++i) {
+		if (!(profile->mask & BIT(i))) {
+			continue;
+		}
+
+		u32 in_buf = profile->value[i];
+		if (gb_turbo_hold(&wmi->turbo, gb_profile_fields[i].method_id,
+				  in_buf)) {
+			pr_info("%s=%u held until the turbo burst ends\n",
+				gb_profile_fields[i].name, in_buf);
+			continue;
+		}
+		status = gigabyte_wmi_set(gb_profile_fields[i].method_id,
+					  &in_buf, sizeof(in_buf), NULL);
+		if (status) {
+			pr_warn("Failed to apply %s=%u: %d\n",
+				gb_profile_fields[i].name, in_buf, status);
+			break;
+		}
+	}
+	mutex_unlock(&wmi->set_lock);
+	mutex_unlock(&wmi->turbo.lock);
+
+	return status;
+}
+
+static void gb_power_profiles_update(struct gigabyte_wmi *wmi, bool force)
+{
+	struct gb_power_profiles *profiles = &wmi->profiles;
+
+	int online = power_supply_is_system_supplied() > 0;
+
+	mutex_lock(&profiles->lock);
+	bool changed = online != profiles->ac_online;
+	profiles->ac_online = online;
+	if (profiles->auto_switch && (changed || force)) {
+		const struct gb_profile *profile =
+			online ? &profiles->ac : &profiles->battery;
+		if (profile->mask) {
+			int status = gb_profile_apply(wmi, profile);
+			if (!status) {
+				pr_info("Applied %s profile\n",
+					online ? "AC" : "battery");
+			}
+		}
+	}
+	mutex_unlock(&profiles->lock);
+}
+
+static void gb_power_profiles_work(struct work_struct *work)
+{
+	struct gb_power_profiles *profiles =
+		container_of(work, struct gb_power_profiles, work);
+	struct gigabyte_wmi *wmi =
+		container_of(profiles, struct gigabyte_wmi, profiles);
+
+	gb_power_profiles_update(wmi, false);
+}
+
+static int gb_power_supply_notify(struct notifier_block *nb,
+				  unsigned long event, void *data)
+{
+	struct gb_power_profiles *profiles =
+		container_of(nb, struct gb_power_profiles, nb);
+
+	// The notifier chain is atomic, the EC is reprogrammed from a work.
+	if (PSY_EVENT_PROP_CHANGED == event) {
+		queue_work(system_unbound_wq, &profiles->work);
+	}
+
+	return NOTIFY_OK;
+}
+
+static ssize_t ac_show(struct device *dev, struct device_attribute *attr,
+		       char *buf)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	mutex_lock(&wmi->profiles.lock);
+	ssize_t len = gb_profile_emit(&wmi->profiles.ac, buf);
+	mutex_unlock(&wmi->profiles.lock);
+
+	return len;
+}
+
+static ssize_t ac_store(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	struct gb_profile profile;
+	int status = gb_profile_parse(buf, &profile);
+	if (status) {
+		return status;
+	}
+
+	mutex_lock(&wmi->profiles.lock);
+	wmi->profiles.ac = profile;
+	mutex_unlock(&wmi->profiles.lock);
+
+	return count;
+}
+
+static ssize_t battery_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	mutex_lock(&wmi->profiles.lock);
+	ssize_t len = gb_profile_emit(&wmi->profiles.battery, buf);
+	mutex_unlock(&wmi->profiles.lock);
+
+	return len;
+}
+
+static ssize_t battery_store(struct device *dev, struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	struct gb_profile profile;
+	int status = gb_profile_parse(buf, &profile);
+	if (status) {
+		return status;
+	}
+
+	mutex_lock(&wmi->profiles.lock);
+	wmi->profiles.battery = profile;
+	mutex_unlock(&wmi->profiles.lock);
+
+	return count;
+}
+
+static ssize_t auto_switch_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%d\n", READ_ONCE(wmi->profiles.auto_switch));
+}
+
+static ssize_t auto_switch_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	bool enable;
+	int status = kstrtobool(buf, &enable);
+	if (status) {
+		return status;
+	}
+
+	mutex_lock(&wmi->profiles.lock);
+	wmi->profiles.auto_switch = enable;
+	mutex_unlock(&wmi->profiles.lock);
+
+	// Bring the machine into the profile of the current power source
+	// right away instead of waiting for the next transition.
+	if (enable) {
+		gb_power_profiles_update(wmi, true);
+	}
+
+	return count;
+}
+
+static ssize_t power_source_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%s\n",
+			  power_supply_is_system_supplied() > 0 ? "ac" :
+								  "battery");
+}
+
+static ssize_t apply_store(struct device *dev, struct device_attribute *attr,
+			   const char *buf, size_t count)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	struct gb_profile profile;
+	int status = gb_profile_parse(buf, &profile);
+	if (status) {
+		return status;
+	}
+
+	status = gb_profile_apply(wmi, &profile);
+	if (status) {
+		return status;
+	}
+
+	pr_info("Applied profile\n");
+
+	return count;
+}
+
+// The stores reject a window and interval that would need more than
+// GB_STATS_MAX_SAMPLES samples, so the window is never cut short.
+static bool gb_sampler_window_fits(unsigned int window_s,
+				   unsigned int interval_ms)
+{
+	return window_s * MSEC_PER_SEC / interval_ms <= GB_STATS_MAX_SAMPLES;
+}
+
+static unsigned int gb_sampler_window_samples(struct gb_sampler *sampler)
+{
+	unsigned int samples = sampler->window_s * MSEC_PER_SEC /
+			       sampler->interval_ms;
+
+	return max(samples, 1U);
+}
+
+static void gb_sampler_reset_stats(struct gb_sampler *sampler)
+{
+	for (int i = 0; i < GB_SENSOR_COUNT; ++i) {
+		sampler->stats[i].head = 0;
+		sampler->stats[i].count = 0;
+		sampler->stats[i].ema = 0;
+	}
+}
+
+static void gb_sampler_account(struct gb_sampler *sampler, int sensor,
+			       u16 value)
+{
+	struct gb_sensor_stats *stats = &sampler->stats[sensor];
+	unsigned int window = gb_sampler_window_samples(sampler);
+
+	stats->samples[stats->head] = value;
+	stats->head = (stats->head + 1) % window;
+	if (stats->count < window) {
+		++stats->count;
+	}
+
+	// Exponential moving average with the window as its time constant,
+	// alpha = 2 / (N + 1).
+	s64 scaled = (s64)value * 1000;
+	if (1 == stats->count) {
+		stats->ema = scaled;
+	} else {
+		stats->ema += div_s64(2 * (scaled - stats->ema), window + 1);
+	}
+}
+
+// Must be called with sampler->lock held.
+static void gb_throttle_reset(struct gb_throttle *thr)
+{
+	thr->cpu_near = false;
+	thr->gpu_near = false;
+	memset(thr->stalled, 0, sizeof(thr->stalled));
+	thr->cpu_events = 0;
+	thr->gpu_events = 0;
+	thr->stall_events = 0;
+	thr->cpu_ms = 0;
+	thr->gpu_ms = 0;
+	thr->cpu_last = 0;
+	thr->gpu_last = 0;
+	thr->stall_last = 0;
+	thr->last_ns = ktime_get_ns();
+}
+
+// Must be called with sampler->lock held. Events are counted when a
+// condition starts, the time is accumulated while it lasts.
+static void gb_throttle_account(struct gb_sampler *sampler)
+{
+	struct gb_throttle *thr = &sampler->throttle;
+	const unsigned long valid = sampler->valid;
+	const u16 *latest = sampler->latest;
+
+	u64 now = ktime_get_ns();
+	u64 elapsed_ms = div_u64(now - thr->last_ns, NSEC_PER_MSEC);
+	thr->last_ns = now;
+	time64_t stamp = ktime_get_boottime_seconds();
+
+	bool cpu_near = false;
+	unsigned int hottest = 0;
+	if (valid & BIT(GB_SENSOR_CPU_TEMP)) {
+		hottest = latest[GB_SENSOR_CPU_TEMP];
+		cpu_near = latest[GB_SENSOR_CPU_TEMP] + thr->margin >=
+			   thr->cpu_limit;
+	}
+	if (cpu_near) {
+		if (!thr->cpu_near) {
+			thr->cpu_events++;
+			thr->cpu_last = stamp;
+		}
+		thr->cpu_ms += elapsed_ms;
+	}
+	thr->cpu_near = cpu_near;
+
+	unsigned int gpu_temp = 0;
+	for (int i = GB_SENSOR_GPU_TEMP1; i <= GB_SENSOR_GPU_TEMP2; ++i) {
+		if (valid & BIT(i)) {
+			gpu_temp = max(gpu_temp, (unsigned int)latest[i]);
+		}
+	}
+	hottest = max(hottest, gpu_temp);
+	bool gpu_near = thr->target_valid && thr->thermal_target &&
+			gpu_temp + thr->margin >= thr->thermal_target;
+	if (gpu_near) {
+		if (!thr->gpu_near) {
+			thr->gpu_events++;
+			thr->gpu_last = stamp;
+		}
+		thr->gpu_ms += elapsed_ms;
+	}
+	thr->gpu_near = gpu_near;
+
+	// The fans stop when the machine is cool, so a fan standing still is
+	// only a problem when it is hot.
+	for (int i = 0; i < GB_FAN_COUNT; ++i) {
+		int sensor = GB_SENSOR_RPM1 + i;
+		if (!(valid & BIT(sensor))) {
+			continue;
+		}
+		bool stalled = 0 == latest[sensor] && hottest >= thr->stall_temp;
+		if (stalled && !thr->stalled[i]) {
+			thr->stall_events++;
+			thr->stall_last = stamp;
+		}
+		thr->stalled[i] = stalled;
+	}
+}
+
+// Adds the time since the previous sample to the perf integrals and stores
+// the new values. A value that could not be read keeps its previous reading.
+static void gb_pmu_account(struct gb_sampler *sampler, const u16 *values,
+			   unsigned long valid)
+{
+	struct gigabyte_wmi *wmi =
+		container_of(sampler, struct gigabyte_wmi, sampler);
+
+	static const u32 duty_method[] = {
+		[GB_PMU_CPU_FAN_DUTY - GB_SENSOR_COUNT] = GB_METHOD_CPU_FAN_DUTY,
+		[GB_PMU_GPU_FAN_DUTY - GB_SENSOR_COUNT] = GB_METHOD_GPU_FAN_DUTY,
+	};
+	u8 duty[ARRAY_SIZE(duty_method)];
+	unsigned long duty_valid = 0;
+	mutex_lock(&wmi->get_lock);
+	for (int i = 0; i < ARRAY_SIZE(duty_method); ++i) {
+		if (!gigabyte_wmi_get(duty_method[i], NULL, 0, &duty[i],
+				      sizeof(duty[i]))) {
+			duty_valid |= BIT(i);
+		}
+	}
+	mutex_unlock(&wmi->get_lock);
+
+	u64 now = ktime_get_ns();
+
+	// .read runs in the perf IPI and takes the read side in hardirq.
+	unsigned long flags;
+	write_seqlock_irqsave(&sampler->pmu_seq, flags);
+	if (sampler->pmu_stamp) {
+		u64 us = div_u64(now - sampler->pmu_stamp, NSEC_PER_USEC);
+		for (int i = 0; i < GB_PMU_EVENT_COUNT; ++i) {
+			sampler->pmu_total[i] += (u64)sampler->pmu_value[i] * us;
+		}
+	}
+	for (int i = 0; i < GB_SENSOR_COUNT; ++i) {
+		if (valid & BIT(i)) {
+			sampler->pmu_value[i] = values[i];
+		}
+	}
+	for (int i = 0; i < ARRAY_SIZE(duty_method); ++i) {
+		if (duty_valid & BIT(i)) {
+			sampler->pmu_value[GB_SENSOR_COUNT + i] = duty[i];
+		}
+	}
+	sampler->pmu_stamp = now;
+	write_sequnlock_irqrestore(&sampler->pmu_seq, flags);
+}
+
+// Runs the attached BPF policy on the latest sample and applies the targets
+// it returns. A target is only written when it changes.
+static void gb_policy_tick(struct gb_sampler *sampler, const u16 *values,
+			   unsigned long valid)
+{
+	struct gigabyte_wmi *wmi =
+		container_of(sampler, struct gigabyte_wmi, sampler);
+
+	if (!rcu_access_pointer(gb_policy)) {
+		return;
+	}
+
+	rcu_read_lock();
+	struct gb_policy_ops *ops = rcu_dereference(gb_policy);
+	if (!ops) {
+		rcu_read_unlock();
+		return;
+	}
+
+	// Pairs with rcu_assign_pointer() in gb_policy_reg(), so a new policy
+	// is seen together with its generation and starts from fresh
+	// bookkeeping.
+	smp_rmb();
+	unsigned int gen = READ_ONCE(sampler->policy_gen);
+	if (gen != sampler->policy_seen) {
+		for (int i = 0; i < GB_POLICY_TARGET_COUNT; ++i) {
+			sampler->policy_applied[i] = GB_POLICY_KEEP;
+		}
+		sampler->policy_wall = 0;
+		sampler->policy_seen = gen;
+	}
+
+	u64 idle, wall;
+	gb_governor_cpu_times(&idle, &wall);
+	u32 load = 0;
+	if (sampler->policy_wall && wall > sampler->policy_wall) {
+		u64 wall_delta = wall - sampler->policy_wall;
+		u64 busy = wall_delta - min(idle - sampler->policy_idle,
+					    wall_delta);
+		load = div64_u64(busy * 100, wall_delta);
+	}
+	sampler->policy_idle = idle;
+	sampler->policy_wall = wall;
+
+	struct gb_policy_state state = {
+		.valid = valid,
+		.load = load,
+		.interval_ms = READ_ONCE(sampler->interval_ms),
+		.time_ns = ktime_get_boottime_ns(),
+	};
+	memcpy(state.sensors, values, sizeof(state.sensors));
+	for (int i = 0; i < GB_POLICY_TARGET_COUNT; ++i) {
+		state.target[i] = GB_POLICY_KEEP;
+	}
+
+	char name[sizeof(((struct gb_policy_ops *)0)->name)];
+	strscpy(name, ops->name, sizeof(name));
+	ops->tick(&state);
+	rcu_read_unlock();
+
+	mutex_lock(&wmi->set_lock);
+	gb_write_queue_drain(wmi);
+	for (int i = 0; i < GB_POLICY_TARGET_COUNT; ++i) {
+		s32 target = state.target[i];
+		if (GB_POLICY_KEEP == target ||
+		    target == sampler->policy_applied[i]) {
+			continue;
+		}
+		if (target < 0 || target > gb_policy_targets[i].max) {
+			pr_warn_ratelimited("Policy %s: %s=%d is out of range\n",
+					    name, gb_policy_targets[i].name,
+					    target);
+			continue;
+		}
+
+		u32 value = target;
+		int status = gigabyte_wmi_set(gb_policy_targets[i].method_id,
+					      &value, sizeof(value), NULL);
+		if (status) {
+			pr_warn_ratelimited("Policy %s: failed to set %s: %d\n",
+					    name, gb_policy_targets[i].name,
+					    status);
+			continue;
+		}
+		sampler->policy_applied[i] = target;
+	}
+	mutex_unlock(&wmi->set_lock);
+}
+
+static void gb_sampler_work(struct work_struct *work)
+{
+	struct gb_sampler *sampler =
+		container_of(to_delayed_work(work), struct gb_sampler, work);
+
+	u16 values[GB_SENSOR_COUNT];
+	unsigned long valid = 0;
+	for (int i = 0; i < GB_SENSOR_COUNT; ++i) {
+		if (!gigabyte_wmi_get(gb_sensor_method[i], NULL, 0, &values[i],
+				      sizeof(values[i]))) {
+			valid |= BIT(i);
+		}
+	}
+
+	u8 target = 0;
+	u8 health = 0;
+	bool target_valid = false;
+	bool health_valid = false;
+	if (READ_ONCE(sampler->throttle_enabled)) {
+		target_valid = !gigabyte_wmi_get(GB_METHOD_NV_THERMAL_TARGET,
+						 NULL, 0, &target,
+						 sizeof(target));
+		health_valid = !gigabyte_wmi_get(GB_METHOD_FAN_HEALTH, NULL, 0,
+						 &health, sizeof(health));
+	}
+
+	if (READ_ONCE(sampler->pmu_users)) {
+		gb_pmu_account(sampler, values, valid);
+	}
+
+	gb_policy_tick(sampler, values, valid);
+
+	mutex_lock(&sampler->lock);
+	sampler->valid = valid;
+	for (int i = 0; i < GB_SENSOR_COUNT; ++i) {
+		if (!(valid & BIT(i))) {
+			continue;
+		}
+		sampler->latest[i] = values[i];
+		if (sampler->stats_enabled) {
+			gb_sampler_account(sampler, i, values[i]);
+		}
+	}
+	if (sampler->throttle_enabled) {
+		struct gb_throttle *thr = &sampler->throttle;
+		if (target_valid) {
+			thr->target_valid = true;
+			thr->thermal_target = target;
+		}
+		thr->health_valid = health_valid;
+		thr->fan_health = health;
+		gb_throttle_account(sampler);
+	}
+
+	if (sampler->users) {
+		queue_delayed_work(system_unbound_wq, &sampler->work,
+				   msecs_to_jiffies(sampler->interval_ms));
+	}
+	mutex_unlock(&sampler->lock);
+}
+
+static void gb_sampler_init(struct gb_sampler *sampler)
+{
+	mutex_init(&sampler->lock);
+	seqlock_init(&sampler->pmu_seq);
+	INIT_DELAYED_WORK(&sampler->work, gb_sampler_work);
+	sampler->interval_ms = 1000;
+	sampler->window_s = 60;
+	sampler->throttle.cpu_limit = 100;
+	sampler->throttle.margin = 3;
+	sampler->throttle.stall_temp = 70;
+}
+
+// Must be called with sampler->lock held.
+static void gb_sampler_get(struct gb_sampler *sampler)
+{
+	if (0 == sampler->users++) {
+		queue_delayed_work(system_unbound_wq, &sampler->work, 0);
+	}
+}
+
+// Must be called with sampler->lock held. The work stops re-arming itself
+// once the last user is gone.
+static void gb_sampler_put(struct gb_sampler *sampler)
+{
+	--sampler->users;
+}
+
+// Detaches the policy from wmi, the device it runs on. Must be called with
+// gb_policy_lock held.
+static void gb_policy_detach(struct gigabyte_wmi *wmi)
+{
+	struct gb_policy_ops *ops = rcu_dereference_protected(
+		gb_policy, lockdep_is_held(&gb_policy_lock));
+	if (!ops) {
+		return;
+	}
+
+	mutex_lock(&wmi->sampler.lock);
+	RCU_INIT_POINTER(gb_policy, NULL);
+	gb_sampler_put(&wmi->sampler);
+	mutex_unlock(&wmi->sampler.lock);
+	synchronize_rcu();
+
+	pr_info("BPF policy %s detached\n", ops->name);
+}
+
+static void gb_sampler_stop(struct gb_sampler *sampler)
+{
+	mutex_lock(&sampler->lock);
+	sampler->users = 0;
+	mutex_unlock(&sampler->lock);
+
+	cancel_delayed_work_sync(&sampler->work);
+}
+
+// The perf events count the time integral of a value, in value microseconds.
+// Their scale turns that into value seconds, so perf stat -I 1000 prints the
+// average of each interval.
+static u64 gb_pmu_total(struct gb_sampler *sampler, int value)
+{
+	u64 now = ktime_get_ns();
+	u64 total;
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&sampler->pmu_seq);
+		total = sampler->pmu_total[value];
+		if (sampler->pmu_stamp && now > sampler->pmu_stamp) {
+			total += (u64)sampler->pmu_value[value] *
+				 div_u64(now - sampler->pmu_stamp,
+					 NSEC_PER_USEC);
+		}
+	} while (read_seqretry(&sampler->pmu_seq, seq));
+
+	return total;
+}
+
+static struct gigabyte_wmi *gb_pmu_to_wmi(struct pmu *pmu)
+{
+	return container_of(pmu, struct gigabyte_wmi, pmu);
+}
+
+static void gb_pmu_event_update(struct perf_event *event)
+{
+	struct gigabyte_wmi *wmi = gb_pmu_to_wmi(event->pmu);
+
+	u64 total = gb_pmu_total(&wmi->sampler, event->attr.config);
+	u64 prev = local64_xchg(&event->hw.prev_count, total);
+	local64_add(total - prev, &event->count);
+}
+
+static void gb_pmu_event_destroy(struct perf_event *event)
+{
+	struct gb_sampler *sampler = &gb_pmu_to_wmi(event->pmu)->sampler;
+
+	mutex_lock(&sampler->lock);
+	--sampler->pmu_users;
+	gb_sampler_put(sampler);
+	mutex_unlock(&sampler->lock);
+}
+
+static int gb_pmu_event_init(struct perf_event *event)
+{
+	struct gigabyte_wmi *wmi = gb_pmu_to_wmi(event->pmu);
+	struct gb_sampler *sampler = &wmi->sampler;
+
+	if (event->attr.type != event->pmu->type) {
+		return -ENOENT;
+	}
+
+	// The values are system wide and only change once per sampler
+	// interval, there is nothing to sample or to attribute to a task.
+	if (is_sampling_event(event) || event->attach_state & PERF_ATTACH_TASK ||
+	    event->cpu < 0) {
+		return -EINVAL;
+	}
+
+	if (event->attr.config >= GB_PMU_EVENT_COUNT) {
+		return -EINVAL;
+	}
+
+	event->cpu = wmi->pmu_cpu;
+
+	mutex_lock(&sampler->lock);
+	if (0 == sampler->pmu_users++) {
+		// The integrals restart from the next sample.
+		unsigned long flags;
+		write_seqlock_irqsave(&sampler->pmu_seq, flags);
+		sampler->pmu_stamp = 0;
+		write_sequnlock_irqrestore(&sampler->pmu_seq, flags);
+	}
+	gb_sampler_get(sampler);
+	mutex_unlock(&sampler->lock);
+
+	event->destroy = gb_pmu_event_destroy;
+
+	return 0;
+}
+
+static void gb_pmu_event_start(struct perf_event *event, int flags)
+{
+	struct gigabyte_wmi *wmi = gb_pmu_to_wmi(event->pmu);
+
+	local64_set(&event->hw.prev_count,
+		    gb_pmu_total(&wmi->sampler, event->attr.config));
+	event->hw.state = 0;
+}
+
+static void gb_pmu_event_stop(struct perf_event *event, int flags)
+{
+	if (event->hw.state & PERF_HES_STOPPED) {
+		return;
+	}
+
+	if (flags & PERF_EF_UPDATE) {
+		gb_pmu_event_update(event);
+	}
+	event->hw.state |= PERF_HES_STOPPED | PERF_HES_UPTODATE;
+}
+
+static int gb_pmu_event_add(struct perf_event *event, int flags)
+{
+	event->hw.state = PERF_HES_STOPPED | PERF_HES_UPTODATE;
+	if (flags & PERF_EF_START) {
+		gb_pmu_event_start(event, flags);
+	}
+
+	return 0;
+}
+
+static void gb_pmu_event_del(struct perf_event *event, int flags)
+{
+	gb_pmu_event_stop(event, PERF_EF_UPDATE);
+}
+
+static ssize_t cpumask_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct gigabyte_wmi *wmi = gb_pmu_to_wmi(dev_get_drvdata(dev));
+
+	return cpumap_print_to_pagebuf(true, buf, cpumask_of(wmi->pmu_cpu));
+}
+
+static DEVICE_ATTR_RO(cpumask);
+
+static struct attribute *gb_pmu_cpumask_attrs[] = {
+	&dev_attr_cpumask.attr,
+	NULL,
+};
+
+static const struct attribute_group gb_pmu_cpumask_group = {
+	.attrs = gb_pmu_cpumask_attrs,
+};
+
+PMU_FORMAT_ATTR(event, "config:0-7");
+
+static struct attribute *gb_pmu_format_attrs[] = {
+	&format_attr_event.attr,
+	NULL,
+};
+
+static const struct attribute_group gb_pmu_format_group = {
+	.name = "format",
+	.attrs = gb_pmu_format_attrs,
+};
+
+#define GB_PMU_EVENT(_name, _id, _str_unit)                                    \
+	PMU_EVENT_ATTR_STRING(_name, gb_pmu_##_name, "event=" #_id);           \
+	PMU_EVENT_ATTR_STRING(_name.unit, gb_pmu_##_name##_unit, _str_unit);   \
+	PMU_EVENT_ATTR_STRING(_name.scale, gb_pmu_##_name##_scale, "1e-6")
+
+#define GB_PMU_EVENT_ATTRS(_name)                                              \
+	&gb_pmu_##_name.attr.attr, &gb_pmu_##_name##_unit.attr.attr,           \
+		&gb_pmu_##_name##_scale.attr.attr
+
+GB_PMU_EVENT(cpu_temp, 0, "C");
+GB_PMU_EVENT(gpu_temp1, 1, "C");
+GB_PMU_EVENT(gpu_temp2, 2, "C");
+GB_PMU_EVENT(rpm1, 3, "RPM");
+GB_PMU_EVENT(rpm2, 4, "RPM");
+GB_PMU_EVENT(cpu_fan_duty, 5, "duty");
+GB_PMU_EVENT(gpu_fan_duty, 6, "duty");
+
+static struct attribute *gb_pmu_event_attrs[] = {
+	GB_PMU_EVENT_ATTRS(cpu_temp),	  GB_PMU_EVENT_ATTRS(gpu_temp1),
+	GB_PMU_EVENT_ATTRS(gpu_temp2),	  GB_PMU_EVENT_ATTRS(rpm1),
+	GB_PMU_EVENT_ATTRS(rpm2),	  GB_PMU_EVENT_ATTRS(cpu_fan_duty),
+	GB_PMU_EVENT_ATTRS(gpu_fan_duty), NULL,
+};
+
+static const struct attribute_group gb_pmu_event_group = {
+	.name = "events",
+	.attrs = gb_pmu_event_attrs,
+};
+
+static const struct attribute_group *gb_pmu_attr_groups[] = {
+	&gb_pmu_format_group,
+	&gb_pmu_event_group,
+	&gb_pmu_cpumask_group,
+	NULL,
+};
+
+static enum cpuhp_state gb_pmu_cpuhp_state;
+
+// Moves the events to another online CPU when theirs goes offline.
+static int gb_pmu_cpu_offline(unsigned int cpu, struct hlist_node *node)
+{
+	struct gigabyte_wmi *wmi =
+		hlist_entry_safe(node, struct gigabyte_wmi, pmu_node);
+
+	if (cpu != wmi->pmu_cpu) {
+		return 0;
+	}
+
+	spin_lock(&gb_wmi_lock);
+	unsigned int target =
+		cpumask_any_and_but(&gb_wmi_cpus, cpu_online_mask, cpu);
+	spin_unlock(&gb_wmi_lock);
+	if (target >= nr_cpu_ids) {
+		target = cpumask_any_but(cpu_online_mask, cpu);
+	}
+	if (target >= nr_cpu_ids) {
+		return 0;
+	}
+
+	perf_pmu_migrate_context(&wmi->pmu, cpu, target);
+	wmi->pmu_cpu = target;
+
+	return 0;
+}
+
+static void gb_pmu_register(struct gigabyte_wmi *wmi)
+{
+	int err = cpuhp_setup_state_multi(CPUHP_AP_ONLINE_DYN,
+					  "perf/gigabyte_wmi:online", NULL,
+					  gb_pmu_cpu_offline);
+	if (err < 0) {
+		pr_warn("Failed to set up the perf PMU hotplug state: %d\n", err);
+		return;
+	}
+	gb_pmu_cpuhp_state = err;
+
+	// The events run on a housekeeping CPU, like the WMI worker. The
+	// hotplug lock keeps the CPU online until the instance can move it.
+	cpus_read_lock();
+	spin_lock(&gb_wmi_lock);
+	wmi->pmu_cpu = cpumask_first_and(&gb_wmi_cpus, cpu_online_mask);
+	spin_unlock(&gb_wmi_lock);
+	if (wmi->pmu_cpu >= nr_cpu_ids) {
+		wmi->pmu_cpu = cpumask_first(cpu_online_mask);
+	}
+
+	wmi->pmu = (struct pmu){
+		.module = THIS_MODULE,
+		.task_ctx_nr = perf_invalid_context,
+		.capabilities = PERF_PMU_CAP_NO_EXCLUDE,
+		.attr_groups = gb_pmu_attr_groups,
+		.event_init = gb_pmu_event_init,
+		.add = gb_pmu_event_add,
+		.del = gb_pmu_event_del,
+		.start = gb_pmu_event_start,
+		.stop = gb_pmu_event_stop,
+		.read = gb_pmu_event_update,
+	};
+
+	err = cpuhp_state_add_instance_nocalls_cpuslocked(gb_pmu_cpuhp_state,
+							  &wmi->pmu_node);
+	cpus_read_unlock();
+	if (err) {
+		pr_warn("Failed to add the perf PMU hotplug instance: %d\n",
+			err);
+		goto remove_state;
+	}
+
+	err = perf_pmu_register(&wmi->pmu, "gigabyte_wmi", -1);
+	if (err) {
+		pr_warn("Failed to register the perf PMU: %d\n", err);
+		goto remove_instance;
+	}
+	wmi->pmu_registered = true;
+	return;
+
+remove_instance:
+	cpuhp_state_remove_instance_nocalls(gb_pmu_cpuhp_state, &wmi->pmu_node);
+remove_state:
+	cpuhp_remove_multi_state(gb_pmu_cpuhp_state);
+}
+
+static void gb_pmu_unregister(struct gigabyte_wmi *wmi)
+{
+	if (wmi->pmu_registered) {
+		perf_pmu_unregister(&wmi->pmu);
+		cpuhp_state_remove_instance_nocalls(gb_pmu_cpuhp_state,
+						    &wmi->pmu_node);
+		cpuhp_remove_multi_state(gb_pmu_cpuhp_state);
+	}
+}
+
+#if IS_ENABLED(CONFIG_BPF_JIT) && IS_ENABLED(CONFIG_BPF_SYSCALL)
+static const struct btf_type *gb_policy_state_type;
+
+static int gb_policy_bpf_init(struct btf *btf)
+{
+	s32 type_id = btf_find_by_name_kind(btf, "gb_policy_state",
+					    BTF_KIND_STRUCT);
+	if (type_id < 0) {
+		return -EINVAL;
+	}
+	gb_policy_state_type = btf_type_by_id(btf, type_id);
+
+	return 0;
+}
+
+static bool gb_policy_is_valid_access(int off, int size,
+				      enum bpf_access_type type,
+				      const struct bpf_prog *prog,
+				      struct bpf_insn_access_aux *info)
+{
+	return bpf_tracing_btf_ctx_access(off, size, type, prog, info);
+}
+
+// The sensor readings are read only, a policy may only write its targets.
+static int gb_policy_btf_struct_access(struct bpf_verifier_log *log,
+				       const struct bpf_reg_state *reg,
+				       int off, int size)
+{
+	const struct btf_type *t = btf_type_by_id(reg->btf, reg->btf_id);
+	if (t != gb_policy_state_type) {
+		bpf_log(log, "only gb_policy_state can be written\n");
+		return -EACCES;
+	}
+
+	size_t start = offsetof(struct gb_policy_state, target);
+	size_t end = start + sizeof(((struct gb_policy_state *)0)->target);
+	if (off < start || off + size > end) {
+		bpf_log(log, "write to gb_policy_state at %d is not allowed\n",
+			off);
+		return -EACCES;
+	}
+
+	return 0;
+}
+
+static const struct bpf_verifier_ops gb_policy_verifier_ops = {
+	.get_func_proto = bpf_base_func_proto,
+	.is_valid_access = gb_policy_is_valid_access,
+	.btf_struct_access = gb_policy_btf_struct_access,
+};
+
+static int gb_policy_init_member(const struct btf_type *t,
+				 const struct btf_member *member,
+				 void *kdata, const void *udata)
+{
+	const struct gb_policy_ops *uops = udata;
+	struct gb_policy_ops *ops = kdata;
+
+	u32 moff = __btf_member_bit_offset(t, member) / 8;
+	if (offsetof(struct gb_policy_ops, name) == moff) {
+		if (bpf_obj_name_cpy(ops->name, uops->name,
+				     sizeof(ops->name)) <= 0) {
+			return -EINVAL;
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+// Must be called with gb_policy_lock held.
+static struct gigabyte_wmi *gb_policy_device(void)
+{
+	if (!gb_wmi_platform_dev) {
+		return NULL;
+	}
+
+	return platform_get_drvdata(gb_wmi_platform_dev);
+}
+
+// A policy without a tick program would be called through a NULL pointer.
+static int gb_policy_validate(void *kdata)
+{
+	struct gb_policy_ops *ops = kdata;
+
+	if (!ops->tick) {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int gb_policy_reg(void *kdata, struct bpf_link *link)
+{
+	struct gb_policy_ops *ops = kdata;
+
+	mutex_lock(&gb_policy_lock);
+	struct gigabyte_wmi *wmi = gb_policy_device();
+	if (!wmi) {
+		mutex_unlock(&gb_policy_lock);
+		return -ENODEV;
+	}
+
+	// The governor and a turbo burst write the same boost methods.
+	mutex_lock(&wmi->boost_lock);
+	if (READ_ONCE(wmi->governor.enabled) ||
+	    GB_TURBO_IDLE != READ_ONCE(wmi->turbo.phase) ||
+	    rcu_access_pointer(gb_policy)) {
+		mutex_unlock(&wmi->boost_lock);
+		mutex_unlock(&gb_policy_lock);
+		return -EBUSY;
+	}
+
+	struct gb_sampler *sampler = &wmi->sampler;
+	mutex_lock(&sampler->lock);
+	WRITE_ONCE(sampler->policy_gen, sampler->policy_gen + 1);
+	rcu_assign_pointer(gb_policy, ops);
+	gb_sampler_get(sampler);
+	mutex_unlock(&sampler->lock);
+	mutex_unlock(&wmi->boost_lock);
+	mutex_unlock(&gb_policy_lock);
+
+	pr_info("BPF policy %s attached\n", ops->name);
+
+	return 0;
+}
+
+static void gb_policy_unreg(void *kdata, struct bpf_link *link)
+{
+	mutex_lock(&gb_policy_lock);
+	// Unbinding the driver detaches the policy before the device is gone.
+	if (kdata == rcu_access_pointer(gb_policy)) {
+		gb_policy_detach(gb_policy_device());
+	}
+	mutex_unlock(&gb_policy_lock);
+}
+
+static int gb_policy_tick_stub(struct gb_policy_state *state)
+{
+	return 0;
+}
+
+static struct gb_policy_ops gb_policy_cfi_stubs = {
+	.tick = gb_policy_tick_stub,
+};
+
+static struct bpf_struct_ops gb_policy_bpf_ops = {
+	.verifier_ops = &gb_policy_verifier_ops,
+	.init = gb_policy_bpf_init,
+	.init_member = gb_policy_init_member,
+	.validate = gb_policy_validate,
+	.reg = gb_policy_reg,
+	.unreg = gb_policy_unreg,
+	.cfi_stubs = &gb_policy_cfi_stubs,
+	.name = "gb_policy_ops",
+	.owner = THIS_MODULE,
+};
+
+static int gb_policy_register(void)
+{
+	return register_bpf_struct_ops(&gb_policy_bpf_ops, gb_policy_ops);
+}
+#else
+static int gb_policy_register(void)
+{
+	return 0;
+}
+#endif
+
+static ssize_t stats_enabled_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%d\n", READ_ONCE(wmi->sampler.stats_enabled));
+}
+
+static ssize_t stats_enabled_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+	struct gb_sampler *sampler = &wmi->sampler;
+
+	bool enable;
+	int status = kstrtobool(buf, &enable);
+	if (status) {
+		return status;
+	}
+
+	mutex_lock(&sampler->lock);
+	if (enable != sampler->stats_enabled) {
+		sampler->stats_enabled = enable;
+		if (enable) {
+			gb_sampler_reset_stats(sampler);
+			gb_sampler_get(sampler);
+		} else {
+			gb_sampler_put(sampler);
+		}
+	}
+	mutex_unlock(&sampler->lock);
+
+	return count;
+}
+
+static ssize_t stats_interval_ms_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(wmi->sampler.interval_ms));
+}
+
+static ssize_t stats_interval_ms_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	unsigned int interval;
+	int status = kstrtouint(buf, 10, &interval);
+	if (status) {
+		return status;
+	}
+	if (interval < 100 || interval > 60000) {
+		return -EINVAL;
+	}
+
+	// The old samples do not fit the new window, start over.
+	mutex_lock(&wmi->sampler.lock);
+	if (!gb_sampler_window_fits(wmi->sampler.window_s, interval)) {
+		mutex_unlock(&wmi->sampler.lock);
+		return -EINVAL;
+	}
+	wmi->sampler.interval_ms = interval;
+	gb_sampler_reset_stats(&wmi->sampler);
+	mutex_unlock(&wmi->sampler.lock);
+
+	return count;
+}
+
+static ssize_t stats_window_s_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(wmi->sampler.window_s));
+}
+
+static ssize_t stats_window_s_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	unsigned int window;
+	int status = kstrtouint(buf, 10, &window);
+	if (status) {
+		return status;
+	}
+	if (window < 1 || window > 3600) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&wmi->sampler.lock);
+	if (!gb_sampler_window_fits(window, wmi->sampler.interval_ms)) {
+		mutex_unlock(&wmi->sampler.lock);
+		return -EINVAL;
+	}
+	wmi->sampler.window_s = window;
+	gb_sampler_reset_stats(&wmi->sampler);
+	mutex_unlock(&wmi->sampler.lock);
+
+	return count;
+}
+
+static ssize_t stats_reset_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	mutex_lock(&wmi->sampler.lock);
+	gb_sampler_reset_stats(&wmi->sampler);
+	mutex_unlock(&wmi->sampler.lock);
+
+	return count;
+}
+
+static ssize_t throttle_enabled_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%d\n",
+			  READ_ONCE(wmi->sampler.throttle_enabled));
+}
+
+static ssize_t throttle_enabled_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+	struct gb_sampler *sampler = &wmi->sampler;
+
+	bool enable;
+	int status = kstrtobool(buf, &enable);
+	if (status) {
+		return status;
+	}
+
+	mutex_lock(&sampler->lock);
+	if (enable != sampler->throttle_enabled) {
+		sampler->throttle_enabled = enable;
+		if (enable) {
+			gb_throttle_reset(&sampler->throttle);
+			sampler->throttle.target_valid = false;
+			sampler->throttle.health_valid = false;
+			gb_sampler_get(sampler);
+		} else {
+			gb_sampler_put(sampler);
+		}
+	}
+	mutex_unlock(&sampler->lock);
+
+	return count;
+}
+
+static ssize_t throttle_reset_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	mutex_lock(&wmi->sampler.lock);
+	gb_throttle_reset(&wmi->sampler.throttle);
+	mutex_unlock(&wmi->sampler.lock);
+
+	return count;
+}
+
+static ssize_t throttle_status_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+	struct gb_sampler *sampler = &wmi->sampler;
+
+	mutex_lock(&sampler->lock);
+	if (!sampler->throttle_enabled) {
+		mutex_unlock(&sampler->lock);
+		return -ENODATA;
+	}
+
+	const struct gb_throttle *thr = &sampler->throttle;
+	int len = sysfs_emit(
+		buf,
+		"cpu_near_limit=%d\ncpu_events=%u\ncpu_time_ms=%llu\ncpu_last_event=%lld\n"
+		"gpu_thermal_target=%u\ngpu_near_limit=%d\ngpu_events=%u\ngpu_time_ms=%llu\ngpu_last_event=%lld\n",
+		thr->cpu_near, thr->cpu_events, thr->cpu_ms, thr->cpu_last,
+		thr->target_valid ? thr->thermal_target : 0, thr->gpu_near,
+		thr->gpu_events, thr->gpu_ms, thr->gpu_last);
+	for (int i = 0; i < GB_FAN_COUNT; ++i) {
+		len += sysfs_emit_at(buf, len, "fan%d_stalled=%d\n", i + 1,
+				     thr->stalled[i]);
+	}
+	len += sysfs_emit_at(buf, len,
+			     "fan_stall_events=%u\nfan_last_stall=%lld\n",
+			     thr->stall_events, thr->stall_last);
+	if (thr->health_valid) {
+		len += sysfs_emit_at(buf, len, "fan_health=%u\n",
+				     thr->fan_health);
+	}
+	mutex_unlock(&sampler->lock);
+
+	return len;
+}
+
+#define GB_THROTTLE_ATTR(_name, _min, _max)                                    \
+	static ssize_t throttle_##_name##_show(                                \
+		struct device *dev, struct device_attribute *attr, char *buf)  \
+	{                                                                      \
+		struct gigabyte_wmi *wmi = dev_get_drvdata(dev);               \
+		return sysfs_emit(buf, "%u\n",                                 \
+				  READ_ONCE(wmi->sampler.throttle._name));     \
+	}                                                                      \
+	static ssize_t throttle_##_name##_store(struct device *dev,            \
+						struct device_attribute *attr, \
+						const char *buf, size_t count) \
+	{                                                                      \
+		struct gigabyte_wmi *wmi = dev_get_drvdata(dev);               \
+		unsigned int val;                                              \
+		int status = kstrtouint(buf, 10, &val);                        \
+		if (status) {                                                  \
+			return status;                                         \
+		}                                                              \
+		if (val < (_min) || val > (_max)) {                            \
+			return -EINVAL;                                        \
+		}                                                              \
+		mutex_lock(&wmi->sampler.lock);                                \
+		wmi->sampler.throttle._name = val;                             \
+		mutex_unlock(&wmi->sampler.lock);                              \
+		return count;                                                  \
+	}                                                                      \
+	static struct device_attribute dev_attr_throttle_##_name = __ATTR(     \
+		_name, 0644, throttle_##_name##_show, throttle_##_name##_store)
+
+GB_THROTTLE_ATTR(cpu_limit, 1, 150);
+GB_THROTTLE_ATTR(margin, 0, 50);
+GB_THROTTLE_ATTR(stall_temp, 0, 150);
+
+static ssize_t gb_stats_emit(struct gb_sampler *sampler, int sensor, char *buf)
+{
+	struct gb_sensor_stats *stats = &sampler->stats[sensor];
+
+	mutex_lock(&sampler->lock);
+
+	unsigned int window = gb_sampler_window_samples(sampler);
+	unsigned int min = U16_MAX;
+	unsigned int max = 0;
+	u64 sum = 0;
+	for (unsigned int i = 0; i < stats->count; ++i) {
+		unsigned int idx = (stats->head + window - 1 - i) % window;
+		min = min(min, (unsigned int)stats->samples[idx]);
+		max = max(max, (unsigned int)stats->samples[idx]);
+		sum += stats->samples[idx];
+	}
+
+	unsigned int count = stats->count;
+	u64 mean = count ? div_u64(sum * 1000, count) : 0;
+	u64 ema = max_t(s64, stats->ema, 0);
+
+	mutex_unlock(&sampler->lock);
+
+	if (!count) {
+		min = 0;
+	}
+
+	u32 mean_frac, ema_frac;
+	mean = div_u64_rem(mean, 1000, &mean_frac);
+	ema = div_u64_rem(ema, 1000, &ema_frac);
+
+	return sysfs_emit(buf,
+			  "min=%u max=%u mean=%llu.%03u ema=%llu.%03u count=%u\n",
+			  min, max, mean, mean_frac, ema, ema_frac, count);
+}
+
+#define GB_STATS_ATTR(_name, _sensor)                                         \
+	static ssize_t stats_##_name##_show(                                  \
+		struct device *dev, struct device_attribute *attr, char *buf) \
+	{                                                                     \
+		struct gigabyte_wmi *wmi = dev_get_drvdata(dev);              \
+		return gb_stats_emit(&wmi->sampler, _sensor, buf);            \
+	}                                                                     \
+	static struct device_attribute dev_attr_stats_##_name =               \
+		__ATTR(_name, 0444, stats_##_name##_show, NULL)
+
+GB_STATS_ATTR(cpu_temp, GB_SENSOR_CPU_TEMP);
+GB_STATS_ATTR(gpu_temp1, GB_SENSOR_GPU_TEMP1);
+GB_STATS_ATTR(gpu_temp2, GB_SENSOR_GPU_TEMP2);
+GB_STATS_ATTR(rpm1, GB_SENSOR_RPM1);
+GB_STATS_ATTR(rpm2, GB_SENSOR_RPM2);
+
+static ssize_t async_enabled_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%d\n", READ_ONCE(wmi->writes.enabled));
+}
+
+static ssize_t async_enabled_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	bool enable;
+	int status = kstrtobool(buf, &enable);
+	if (status) {
+		return status;
+	}
+
+	if (enable) {
+		WRITE_ONCE(wmi->writes.enabled, true);
+	} else {
+		gb_write_queue_stop(&wmi->writes);
+	}
+
+	return count;
+}
+
+static ssize_t async_submitted_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	spin_lock(&wmi->writes.lock);
+	u64 seq = wmi->writes.submitted;
+	spin_unlock(&wmi->writes.lock);
+
+	return sysfs_emit(buf, "%llu\n", seq);
+}
+
+static ssize_t async_completed_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	spin_lock(&wmi->writes.lock);
+	u64 seq = wmi->writes.completed;
+	spin_unlock(&wmi->writes.lock);
+
+	return sysfs_emit(buf, "%llu\n", seq);
+}
+
+static ssize_t async_last_error_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	spin_lock(&wmi->writes.lock);
+	int err = wmi->writes.last_error;
+	u64 seq = wmi->writes.last_error_seq;
+	spin_unlock(&wmi->writes.lock);
+
+	return sysfs_emit(buf, "%d %llu\n", err, seq);
+}
+
+enum gb_snapshot_kind {
+	GB_SNAPSHOT_GET,
+	// The method returns the inverse of the value written.
+	GB_SNAPSHOT_GET_INVERTED,
+	// Taken from the sampler while it runs.
+	GB_SNAPSHOT_SENSOR,
+	// Because of a bug in the ACPI tables, the value is read with a set
+	// method. These are the slow battery methods, served from
+	// gb_snapshot_cache.
+	GB_SNAPSHOT_SET_AS_GET,
+};
+
+struct gb_snapshot_field {
+	const char *name;
+	u32 method_id;
+	enum gb_snapshot_kind kind;
+};
+
+// Values reported together by the snapshot attribute, so monitoring tools
+// can collect everything with a single read.
+static const struct gb_snapshot_field gb_snapshot_fields[] = {
+	{ "cpu_temp", GB_METHOD_CPU_TEMP, GB_SNAPSHOT_SENSOR },
+	{ "gpu_temp1", GB_METHOD_GPU_TEMP1, GB_SNAPSHOT_SENSOR },
+	{ "gpu_temp2", GB_METHOD_GPU_TEMP2, GB_SNAPSHOT_SENSOR },
+	{ "rpm1", GB_METHOD_RPM1, GB_SNAPSHOT_SENSOR },
+	{ "rpm2", GB_METHOD_RPM2, GB_SNAPSHOT_SENSOR },
+	{ "auto_fan_status", GB_METHOD_AUTO_FAN_STATUS, GB_SNAPSHOT_GET },
+	{ "fixed_fan_status", GB_METHOD_FIXED_FAN_STATUS, GB_SNAPSHOT_GET },
+	{ "step_fan_status", GB_METHOD_STEP_FAN_STATUS, GB_SNAPSHOT_GET },
+	{ "fixed_fan_speed", GB_METHOD_FIXED_FAN_SPEED, GB_SNAPSHOT_GET },
+	{ "cpu_fan_duty", GB_METHOD_CPU_FAN_DUTY, GB_SNAPSHOT_GET },
+	{ "gpu_fan_duty", GB_METHOD_GPU_FAN_DUTY, GB_SNAPSHOT_GET },
+	{ "dynamic_boost_status", GB_METHOD_DYNAMIC_BOOST,
+	  GB_SNAPSHOT_GET_INVERTED },
+	{ "ai_boost_status", GB_METHOD_AI_BOOST_STATUS, GB_SNAPSHOT_GET },
+	{ "whisper_mode", GB_METHOD_WHISPER_MODE, GB_SNAPSHOT_GET },
+	{ "nv_power_config", GB_METHOD_NV_POWER_CONFIG, GB_SNAPSHOT_GET },
+	{ "nv_thermal_target", GB_METHOD_NV_THERMAL_TARGET, GB_SNAPSHOT_GET },
+	{ "battery_health", GB_METHOD_BATTERY_HEALTH, GB_SNAPSHOT_SET_AS_GET },
+	{ "battery_cycle_count", GB_METHOD_BATT_COUNT, GB_SNAPSHOT_SET_AS_GET },
+};
+
+// Battery health and cycle count change over days, a refresh a minute is
+// plenty.
+#define GB_SNAPSHOT_CACHE_TTL_S 60
+
+static void gb_snapshot_cache_work(struct work_struct *work)
+{
+	struct gb_snapshot_cache *cache =
+		container_of(work, struct gb_snapshot_cache, work);
+
+	for (int i = 0; i < ARRAY_SIZE(gb_snapshot_fields); ++i) {
+		const struct gb_snapshot_field *field = &gb_snapshot_fields[i];
+		if (GB_SNAPSHOT_SET_AS_GET != field->kind) {
+			continue;
+		}
+
+		u32 value;
+		int status = gigabyte_wmi_set(field->method_id, NULL, 0, &value);
+
+		spin_lock(&cache->lock);
+		if (status) {
+			cache->valid &= ~BIT(i);
+		} else {
+			cache->valid |= BIT(i);
+			cache->value[i] = value;
+		}
+		spin_unlock(&cache->lock);
+	}
+}
+
+static void gb_snapshot_cache_init(struct gb_snapshot_cache *cache)
+{
+	BUILD_BUG_ON(ARRAY_SIZE(gb_snapshot_fields) > BITS_PER_LONG);
+
+	INIT_WORK(&cache->work, gb_snapshot_cache_work);
+	spin_lock_init(&cache->lock);
+}
+
+// Returns the cached value and starts a refresh when it is out of date. A
+// value that was never read is left out of the snapshot until the refresh
+// finishes.
+static int gb_snapshot_read_cached(struct gigabyte_wmi *wmi, int i,
+				   u32 *value)
+{
+	struct gb_snapshot_cache *cache = &wmi->snapshot;
+
+	// The refresh time is taken when the refresh is started, so readers
+	// that come while it runs do not start another one.
+	spin_lock(&cache->lock);
+	bool stale = !cache->updated ||
+		     time_after(jiffies,
+				cache->updated + GB_SNAPSHOT_CACHE_TTL_S * HZ);
+	if (stale) {
+		cache->updated = jiffies;
+	}
+	bool valid = cache->valid & BIT(i);
+	*value = cache->value[i];
+	spin_unlock(&cache->lock);
+
+	if (stale) {
+		queue_work(system_unbound_wq, &cache->work);
+	}
+
+	return valid ? 0 : -EAGAIN;
+}
+
+// Returns the sampler's latest reading of a sensor while it runs, so the
+// snapshot costs no WMI call for it.
+static bool gb_snapshot_read_sampled(struct gigabyte_wmi *wmi, u32 method_id,
+				     u32 *value)
+{
+	struct gb_sampler *sampler = &wmi->sampler;
+	bool found = false;
+
+	for (int i = 0; i < GB_SENSOR_COUNT; ++i) {
+		if (gb_sensor_method[i] != method_id) {
+			continue;
+		}
+		mutex_lock(&sampler->lock);
+		if (sampler->users && (sampler->valid & BIT(i))) {
+			*value = sampler->latest[i];
+			found = true;
+		}
+		mutex_unlock(&sampler->lock);
+		break;
+	}
+
+	return found;
+}
+
+static int gb_snapshot_read(struct gigabyte_wmi *wmi, int i, u32 *value)
+{
+	const struct gb_snapshot_field *field = &gb_snapshot_fields[i];
+
+	if (GB_SNAPSHOT_SET_AS_GET == field->kind) {
+		return gb_snapshot_read_cached(wmi, i, value);
+	}
+	if (GB_SNAPSHOT_SENSOR == field->kind &&
+	    gb_snapshot_read_sampled(wmi, field->method_id, value)) {
+		return 0;
+	}
+
+	// Like the individual attributes, only the normal lane methods are
+	// read under get_lock.
+	const bool locked =
+		GB_WMI_LANE_NORMAL ==
+		gb_wmi_method_lane[GB_WMI_GET][field->method_id];
+	const u8 el_size = gb_get_method_out_size[field->method_id].size;
+	u8 res8;
+	u16 res16;
+
+	if (locked) {
+		mutex_lock(&wmi->get_lock);
+	}
+	int status;
+	if (1 == el_size) {
+		status = gigabyte_wmi_get(field->method_id, NULL, 0, &res8,
+					  sizeof(res8));
+		*value = res8;
+	} else {
+		status = gigabyte_wmi_get(field->method_id, NULL, 0, &res16,
+					  sizeof(res16));
+		*value = res16;
+	}
+	if (locked) {
+		mutex_unlock(&wmi->get_lock);
+	}
+
+	if (GB_SNAPSHOT_GET_INVERTED == field->kind) {
+		*value = (0 == *value);
+	}
+
+	return status;
+}
+
+static ssize_t snapshot_show(struct device *dev, struct device_attribute *attr,
+			     char *buf)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+	int len = 0;
+
+	// Values that cannot be read are left out.
+	for (int i = 0; i < ARRAY_SIZE(gb_snapshot_fields); ++i) {
+		u32 value;
+		if (gb_snapshot_read(wmi, i, &value)) {
+			continue;
+		}
+		len += sysfs_emit_at(buf, len, "%s=%u\n",
+				     gb_snapshot_fields[i].name, value);
+	}
+
+	return len;
+}
+
+// Must be called with set_lock held.
+static int gb_led_write(struct gigabyte_wmi *wmi, enum gb_led led)
+{
+	struct gb_leds *leds = &wmi->leds;
+
+	switch (led) {
+	case GB_LED_LIGHT_BAR: {
+		struct led_classdev_mc *mc = &leds->light_bar;
+		u8 in_buf[6] = { 0, // index
+				 mc->led_cdev.brightness ? 1 : 0, // status
+				 mc->led_cdev.brightness, // level
+				 mc->subled_info[0].intensity,
+				 mc->subled_info[1].intensity,
+				 mc->subled_info[2].intensity };
+		return gigabyte_wmi_set(GB_METHOD_LIGHT_BAR, in_buf,
+					sizeof(in_buf), NULL);
+	}
+	case GB_LED_RGB: {
+		struct led_classdev_mc *mc = &leds->rgb;
+		u8 in_buf[6] = { 0, // area
+				 0, // mode, static color
+				 mc->led_cdev.brightness,
+				 mc->subled_info[0].intensity,
+				 mc->subled_info[1].intensity,
+				 mc->subled_info[2].intensity };
+		return gigabyte_wmi_set(GB_METHOD_RGB_LED, in_buf,
+					sizeof(in_buf), NULL);
+	}
+	case GB_LED_KBD_BACKLIGHT: {
+		u32 in_buf = leds->kbd_backlight.brightness;
+		return gigabyte_wmi_set(GB_METHOD_KEYBOARD_BACKLIGHT, &in_buf,
+					sizeof(in_buf), NULL);
+	}
+	default:
+		return -EINVAL;
+	}
+}
+
+static int gb_led_update(struct gigabyte_wmi *wmi, enum gb_led led)
+{
+	struct gb_leds *leds = &wmi->leds;
+	int status = 0;
+
+	mutex_lock(&leds->lock);
+	if (leds->frame_mode) {
+		leds->dirty |= BIT(led);
+	} else {
+		mutex_lock(&wmi->set_lock);
+		gb_write_queue_drain(wmi);
+		status = gb_led_write(wmi, led);
+		mutex_unlock(&wmi->set_lock);
+	}
+	mutex_unlock(&leds->lock);
+
+	return status;
+}
+
+static int gb_light_bar_set(struct led_classdev *cdev,
+			    enum led_brightness brightness)
+{
+	struct gb_leds *leds =
+		container_of(cdev, struct gb_leds, light_bar.led_cdev);
+
+	return gb_led_update(container_of(leds, struct gigabyte_wmi, leds),
+			     GB_LED_LIGHT_BAR);
+}
+
+static int gb_rgb_led_set(struct led_classdev *cdev,
+			  enum led_brightness brightness)
+{
+	struct gb_leds *leds = container_of(cdev, struct gb_leds, rgb.led_cdev);
+
+	return gb_led_update(container_of(leds, struct gigabyte_wmi, leds),
+			     GB_LED_RGB);
+}
+
+static int gb_kbd_backlight_set(struct led_classdev *cdev,
+				enum led_brightness brightness)
+{
+	struct gb_leds *leds =
+		container_of(cdev, struct gb_leds, kbd_backlight);
+
+	return gb_led_update(container_of(leds, struct gigabyte_wmi, leds),
+			     GB_LED_KBD_BACKLIGHT);
+}
+
+static void gb_led_init_subleds(struct led_classdev_mc *mc,
+				struct mc_subled *subleds)
+{
+	subleds[0].color_index = LED_COLOR_ID_RED;
+	subleds[1].color_index = LED_COLOR_ID_GREEN;
+	subleds[2].color_index = LED_COLOR_ID_BLUE;
+	for (int i = 0; i < 3; ++i) {
+		subleds[i].channel = i;
+		subleds[i].intensity = U8_MAX;
+	}
+
+	mc->subled_info = subleds;
+	mc->num_colors = 3;
+}
+
+static void gb_leds_register(struct gigabyte_wmi *wmi)
+{
+	struct gb_leds *leds = &wmi->leds;
+
+	mutex_init(&leds->lock);
+
+	// The firmware levels are passed through unchanged, so the LED
+	// brightness is the raw level the EC expects.
+	u8 light_bar[5]; // status, level, red, green, blue
+	u32 index = 0;
+	mutex_lock(&wmi->get_lock);
+	int status = gigabyte_wmi_get(GB_METHOD_LIGHT_BAR, (u8 *)&index,
+				      sizeof(index), light_bar,
+				      sizeof(light_bar));
+	mutex_unlock(&wmi->get_lock);
+	if (!status) {
+		struct led_classdev_mc *mc = &leds->light_bar;
+		gb_led_init_subleds(mc, leds->light_bar_subleds);
+		mc->led_cdev.name = "gigabyte:rgb:lightbar";
+		mc->led_cdev.max_brightness = U8_MAX;
+		mc->led_cdev.brightness = light_bar[0] ? light_bar[1] : 0;
+		mc->led_cdev.brightness_set_blocking = gb_light_bar_set;
+		for (int i = 0; i < 3; ++i) {
+			mc->subled_info[i].intensity = light_bar[2 + i];
+		}
+		if (!devm_led_classdev_multicolor_register(wmi->dev, mc)) {
+			leds->present |= BIT(GB_LED_LIGHT_BAR);
+		}
+	}
+
+	// SetRGBLed has no get counterpart, the LED starts out off.
+	if (gb_model && gb_model->rgb_led) {
+		struct led_classdev_mc *mc = &leds->rgb;
+		gb_led_init_subleds(mc, leds->rgb_subleds);
+		mc->led_cdev.name = "gigabyte:rgb:led";
+		mc->led_cdev.max_brightness = U8_MAX;
+		mc->led_cdev.brightness_set_blocking = gb_rgb_led_set;
+		if (!devm_led_classdev_multicolor_register(wmi->dev, mc)) {
+			leds->present |= BIT(GB_LED_RGB);
+		}
+	}
+
+	u8 level;
+	mutex_lock(&wmi->get_lock);
+	status = gigabyte_wmi_get(GB_METHOD_KEYBOARD_BACKLIGHT, NULL, 0,
+				  &level, sizeof(level));
+	mutex_unlock(&wmi->get_lock);
+	if (!status) {
+		struct led_classdev *cdev = &leds->kbd_backlight;
+		cdev->name = "gigabyte::kbd_backlight";
+		cdev->max_brightness = U8_MAX;
+		cdev->brightness = level;
+		cdev->brightness_set_blocking = gb_kbd_backlight_set;
+		if (!devm_led_classdev_register(wmi->dev, cdev)) {
+			leds->present |= BIT(GB_LED_KBD_BACKLIGHT);
+		}
+	}
+}
+
+// Sends the LEDs changed in frame mode to the EC. Must be called with
+// leds->lock held.
+static int gb_leds_commit(struct gigabyte_wmi *wmi)
+{
+	struct gb_leds *leds = &wmi->leds;
+	int status = 0;
+
+	unsigned long dirty = leds->dirty & leds->present;
+	leds->dirty = 0;
+
+	// One call per changed LED no matter how many times it was touched
+	// while the frame was being staged.
+	unsigned int led;
+	mutex_lock(&wmi->set_lock);
+	gb_write_queue_drain(wmi);
+	for_each_set_bit(led, &dirty, GB_LED_COUNT) {
+		int err = gb_led_write(wmi, led);
+		if (err && !status) {
+			status = err;
+		}
+	}
+	mutex_unlock(&wmi->set_lock);
+
+	return status;
+}
+
+static ssize_t frame_mode_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%d\n", READ_ONCE(wmi->leds.frame_mode));
+}
+
+static ssize_t frame_mode_store(struct device *dev,
+				struct device_attribute *attr, const char *buf,
+				size_t count)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	bool enable;
+	int status = kstrtobool(buf, &enable);
+	if (status) {
+		return status;
+	}
+
+	// Leaving frame mode commits what was staged, like leds/commit.
+	mutex_lock(&wmi->leds.lock);
+	wmi->leds.frame_mode = enable;
+	if (!enable) {
+		status = gb_leds_commit(wmi);
+	}
+	mutex_unlock(&wmi->leds.lock);
+
+	return status ? status : count;
+}
+
+static ssize_t commit_store(struct device *dev, struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	struct gigabyte_wmi *wmi = dev_get_drvdata(dev);
+
+	mutex_lock(&wmi->leds.lock);
+	int status = gb_leds_commit(wmi);
+	mutex_unlock(&wmi->leds.lock);
+
+	return status ? status : count;
+}
+
+static DEVICE_ATTR_RW(cpu_fan_duty);
+static DEVICE_ATTR_RW(gpu_fan_duty);
+static DEVICE_ATTR_WO(current_fan_step);
+static DEVICE_ATTR_RW(fixed_fan_status);
+static DEVICE_ATTR_RW(step_fan_status);
+static DEVICE_ATTR_RW(fixed_fan_speed);
+static DEVICE_ATTR_RW(auto_fan_status);
+static DEVICE_ATTR(curve, 0644, fan_curve_show, fan_curve_store);
+
+static struct attribute *fan_control_attrs[] = {
+	&dev_attr_cpu_fan_duty.attr,	 &dev_attr_gpu_fan_duty.attr,
+	&dev_attr_current_fan_step.attr, &dev_attr_fixed_fan_status.attr,
+	&dev_attr_fixed_fan_speed.attr,	 &dev_attr_step_fan_status.attr,
+	&dev_attr_auto_fan_status.attr,	 &dev_attr_curve.attr,
+	NULL,
+};
+
+static const struct attribute_group fan_control_attribute_group = {
+	.name = "fan_control",
+	.attrs = fan_control_attrs,
+};
+
+static DEVICE_ATTR_RO(battery_cycle_count);
+static DEVICE_ATTR_RO(battery_health);
+
+static struct attribute *battery_attrs[] = {
+	&dev_attr_battery_cycle_count.attr,
+	&dev_attr_battery_health.attr,
+	NULL,
+};
+
+static const struct attribute_group battery_attribute_group = {
+	.name = "battery",
+	.attrs = battery_attrs,
+};
+
+static DEVICE_ATTR_RW(dynamic_boost_status);
+static DEVICE_ATTR_RW(whisper_mode);
+
+static struct attribute *performance_attrs[] = {
+	&dev_attr_dynamic_boost_status.attr, &dev_attr_whisper_mode.attr, NULL
+};
 
 static const struct attribute_group performance_attribute_group = {
 	.name = "performance",
@@ -1027,15 +5085,170 @@ static const struct attribute_group sensors_attribute_group = {
 static DEVICE_ATTR_RW(nv_power_config);
 static DEVICE_ATTR_RW(nv_thermal_target);
 
+static DEVICE_ATTR_RW(power_level);
+
 static struct attribute *gpu_attrs[] = { &dev_attr_nv_power_config.attr,
 					 &dev_attr_nv_thermal_target.attr,
-					 NULL };
+					 &dev_attr_power_level.attr, NULL };
 
 static const struct attribute_group gpu_attribute_group = {
 	.name = "gpu",
 	.attrs = gpu_attrs,
 };
 
+static struct device_attribute dev_attr_governor_enabled =
+	__ATTR(enabled, 0644, governor_enabled_show, governor_enabled_store);
+static struct device_attribute dev_attr_governor_state =
+	__ATTR(state, 0444, governor_state_show, NULL);
+
+static struct attribute *governor_attrs[] = {
+	&dev_attr_governor_enabled.attr,
+	&dev_attr_governor_state.attr,
+	&dev_attr_governor_period_ms.attr,
+	&dev_attr_governor_up_threshold.attr,
+	&dev_attr_governor_down_threshold.attr,
+	&dev_attr_governor_boost_dwell_ms.attr,
+	&dev_attr_governor_quiet_dwell_ms.attr,
+	NULL,
+};
+
+static const struct attribute_group governor_attribute_group = {
+	.name = "governor",
+	.attrs = governor_attrs,
+};
+
+static struct device_attribute dev_attr_async_enabled =
+	__ATTR(enabled, 0644, async_enabled_show, async_enabled_store);
+static struct device_attribute dev_attr_async_submitted =
+	__ATTR(submitted, 0444, async_submitted_show, NULL);
+static struct device_attribute dev_attr_async_completed =
+	__ATTR(completed, 0444, async_completed_show, NULL);
+static struct device_attribute dev_attr_async_last_error =
+	__ATTR(last_error, 0444, async_last_error_show, NULL);
+
+static struct attribute *async_attrs[] = {
+	&dev_attr_async_enabled.attr,	 &dev_attr_async_submitted.attr,
+	&dev_attr_async_completed.attr, &dev_attr_async_last_error.attr,
+	NULL,
+};
+
+static const struct attribute_group async_attribute_group = {
+	.name = "async",
+	.attrs = async_attrs,
+};
+
+static struct device_attribute dev_attr_stats_enabled =
+	__ATTR(enabled, 0644, stats_enabled_show, stats_enabled_store);
+static struct device_attribute dev_attr_stats_interval_ms =
+	__ATTR(interval_ms, 0644, stats_interval_ms_show,
+	       stats_interval_ms_store);
+static struct device_attribute dev_attr_stats_window_s =
+	__ATTR(window_s, 0644, stats_window_s_show, stats_window_s_store);
+static struct device_attribute dev_attr_stats_reset =
+	__ATTR(reset, 0200, NULL, stats_reset_store);
+
+static struct device_attribute dev_attr_turbo_request =
+	__ATTR(request, 0200, NULL, turbo_request_store);
+static struct device_attribute dev_attr_turbo_state =
+	__ATTR(state, 0444, turbo_state_show, NULL);
+
+static struct attribute *turbo_attrs[] = {
+	&dev_attr_turbo_request.attr,
+	&dev_attr_turbo_state.attr,
+	&dev_attr_turbo_budget.attr,
+	&dev_attr_turbo_cpu_limit.attr,
+	&dev_attr_turbo_fan_duty.attr,
+	&dev_attr_turbo_cooldown_s.attr,
+	&dev_attr_turbo_smart_turbo_level.attr,
+	NULL,
+};
+
+static const struct attribute_group turbo_attribute_group = {
+	.name = "turbo",
+	.attrs = turbo_attrs,
+};
+
+static DEVICE_ATTR_RO(snapshot);
+
+static struct attribute *snapshot_attrs[] = {
+	&dev_attr_snapshot.attr,
+	NULL,
+};
+
+static const struct attribute_group snapshot_attribute_group = {
+	.attrs = snapshot_attrs,
+};
+
+static struct device_attribute dev_attr_throttle_enabled = __ATTR(
+	enabled, 0644, throttle_enabled_show, throttle_enabled_store);
+static struct device_attribute dev_attr_throttle_reset =
+	__ATTR(reset, 0200, NULL, throttle_reset_store);
+static DEVICE_ATTR_RO(throttle_status);
+
+static struct attribute *thermal_attrs[] = {
+	&dev_attr_throttle_enabled.attr,
+	&dev_attr_throttle_status.attr,
+	&dev_attr_throttle_cpu_limit.attr,
+	&dev_attr_throttle_margin.attr,
+	&dev_attr_throttle_stall_temp.attr,
+	&dev_attr_throttle_reset.attr,
+	NULL,
+};
+
+static const struct attribute_group thermal_attribute_group = {
+	.name = "thermal",
+	.attrs = thermal_attrs,
+};
+
+static struct attribute *stats_attrs[] = {
+	&dev_attr_stats_enabled.attr,
+	&dev_attr_stats_interval_ms.attr,
+	&dev_attr_stats_window_s.attr,
+	&dev_attr_stats_reset.attr,
+	&dev_attr_stats_cpu_temp.attr,
+	&dev_attr_stats_gpu_temp1.attr,
+	&dev_attr_stats_gpu_temp2.attr,
+	&dev_attr_stats_rpm1.attr,
+	&dev_attr_stats_rpm2.attr,
+	NULL,
+};
+
+static const struct attribute_group stats_attribute_group = {
+	.name = "stats",
+	.attrs = stats_attrs,
+};
+
+static DEVICE_ATTR_RW(frame_mode);
+static DEVICE_ATTR_WO(commit);
+
+static struct attribute *leds_attrs[] = {
+	&dev_attr_frame_mode.attr,
+	&dev_attr_commit.attr,
+	NULL,
+};
+
+static const struct attribute_group leds_attribute_group = {
+	.name = "leds",
+	.attrs = leds_attrs,
+};
+
+static DEVICE_ATTR_RW(ac);
+static DEVICE_ATTR_RW(battery);
+static DEVICE_ATTR_RW(auto_switch);
+static DEVICE_ATTR_RO(power_source);
+static DEVICE_ATTR_WO(apply);
+
+static struct attribute *profiles_attrs[] = {
+	&dev_attr_ac.attr,	     &dev_attr_battery.attr,
+	&dev_attr_auto_switch.attr, &dev_attr_power_source.attr,
+	&dev_attr_apply.attr,	     NULL,
+};
+
+static const struct attribute_group profiles_attribute_group = {
+	.name = "profiles",
+	.attrs = profiles_attrs,
+};
+
 static int gigabyte_wmi_probe(struct platform_device *pdev)
 {
 	struct gigabyte_wmi *wmi;
@@ -1048,24 +5261,97 @@ static int gigabyte_wmi_probe(struct platform_device *pdev)
 	wmi->dev = &pdev->dev;
 	platform_set_drvdata(pdev, wmi);
 
-	if (wmi_has_guid(GB_GET_GUID)) {
+	if (replay || wmi_has_guid(GB_GET_GUID)) {
 		mutex_init(&wmi->get_lock);
 	}
 
-	if (wmi_has_guid(GB_SET_GUID)) {
+	if (replay || wmi_has_guid(GB_SET_GUID)) {
 		mutex_init(&wmi->set_lock);
 	}
 
+	mutex_lock(&wmi->get_lock);
+	gb_ec_setup_fast_path();
+	mutex_unlock(&wmi->get_lock);
+
+	gb_write_queue_init(&wmi->writes);
+	// Every profile is checked against a running turbo burst.
+	gb_turbo_init(&wmi->turbo);
+
+	// The boot profile is applied before anything else can write, so the
+	// machine runs with it from the moment the module is loaded.
+	if (boot_profile) {
+		struct gb_profile boot;
+		int status = gb_profile_parse(boot_profile, &boot);
+		if (!status) {
+			status = gb_profile_apply(wmi, &boot);
+		}
+		if (status) {
+			pr_warn("Failed to apply the boot profile: %d\n",
+				status);
+		} else {
+			pr_info("Boot profile applied\n");
+		}
+	}
+
+	mutex_init(&wmi->boost_lock);
+	gb_governor_init(&wmi->governor);
+
+	gb_sampler_init(&wmi->sampler);
+	gb_snapshot_cache_init(&wmi->snapshot);
+
+	// The notifier is the only step that can fail, so it goes before
+	// anything that would have to be torn down again. The LEDs are device
+	// managed and the PMU is registered last.
+	mutex_init(&wmi->profiles.lock);
+	INIT_WORK(&wmi->profiles.work, gb_power_profiles_work);
+	wmi->profiles.ac_online = -1;
+	wmi->profiles.nb.notifier_call = gb_power_supply_notify;
+	int err = power_supply_reg_notifier(&wmi->profiles.nb);
+	if (err) {
+		return err;
+	}
+
+	gb_leds_register(wmi);
+	gb_pmu_register(wmi);
+
 	return 0;
 }
 
 static void gigabyte_wmi_remove(struct platform_device *pdev)
 {
+	struct gigabyte_wmi *wmi = platform_get_drvdata(pdev);
+
 	sysfs_remove_group(&pdev->dev.kobj, &fan_control_attribute_group);
 	sysfs_remove_group(&pdev->dev.kobj, &battery_attribute_group);
 	sysfs_remove_group(&pdev->dev.kobj, &performance_attribute_group);
 	sysfs_remove_group(&pdev->dev.kobj, &sensors_attribute_group);
 	sysfs_remove_group(&pdev->dev.kobj, &gpu_attribute_group);
+	sysfs_remove_group(&pdev->dev.kobj, &governor_attribute_group);
+	sysfs_remove_group(&pdev->dev.kobj, &profiles_attribute_group);
+	sysfs_remove_group(&pdev->dev.kobj, &async_attribute_group);
+	sysfs_remove_group(&pdev->dev.kobj, &stats_attribute_group);
+	sysfs_remove_group(&pdev->dev.kobj, &leds_attribute_group);
+	sysfs_remove_group(&pdev->dev.kobj, &thermal_attribute_group);
+	sysfs_remove_group(&pdev->dev.kobj, &snapshot_attribute_group);
+	sysfs_remove_group(&pdev->dev.kobj, &turbo_attribute_group);
+
+	// A policy attached later must not find the device, and one that is
+	// attached stops running on it. Its link stays until user space
+	// drops it.
+	mutex_lock(&gb_policy_lock);
+	platform_set_drvdata(pdev, NULL);
+	gb_policy_detach(wmi);
+	mutex_unlock(&gb_policy_lock);
+
+	gb_pmu_unregister(wmi);
+	gb_governor_stop(&wmi->governor);
+	gb_turbo_stop(wmi, &wmi->turbo);
+	gb_write_queue_stop(&wmi->writes);
+	gb_sampler_stop(&wmi->sampler);
+	cancel_work_sync(&wmi->snapshot.work);
+
+	power_supply_unreg_notifier(&wmi->profiles.nb);
+	cancel_work_sync(&wmi->profiles.work);
 }
 
 static struct platform_driver gigabyte_wmi_driver = {.driver =
@@ -1081,6 +5367,26 @@ static int __init gigabyte_wmi_init(void)
 		return -ENODEV;
 	}
 
+	if (0 == trace_records) {
+		pr_err("trace_records must be at least 1\n");
+		return -EINVAL;
+	}
+	if (trace_records > GB_TRACE_MAX_RECORDS) {
+		pr_warn("trace_records limited to %u\n", GB_TRACE_MAX_RECORDS);
+		trace_records = GB_TRACE_MAX_RECORDS;
+	}
+
+	// A replayed trace stands in for the firmware, so the machine does not
+	// have to be a Gigabyte laptop.
+	if (replay) {
+		gb_replay.records = vzalloc(
+			array_size(trace_records, sizeof(struct gb_trace_record)));
+		if (!gb_replay.records) {
+			return -ENOMEM;
+		}
+		goto setup_worker;
+	}
+
 	if (0 == dmi_check_system(gigabyte_supported_platforms)) {
 		pr_err("This system is not supported by %s driver\n",
 		       THIS_MODULE->name);
@@ -1099,9 +5405,52 @@ static int __init gigabyte_wmi_init(void)
 		return -ENODEV;
 	}
 
-	int err = platform_driver_register(&gigabyte_wmi_driver);
+setup_worker:
+	for (int i = 0; i < GB_WMI_LANE_COUNT; ++i) {
+		INIT_LIST_HEAD(&gb_wmi_lanes[i]);
+	}
+	kthread_init_work(&gb_wmi_dispatch_work, gb_wmi_dispatch);
+	gb_wmi_worker = kthread_create_worker(0, "gigabyte-wmi");
+	if (IS_ERR(gb_wmi_worker)) {
+		vfree(gb_replay.records);
+		return PTR_ERR(gb_wmi_worker);
+	}
+	mutex_lock(&gb_wmi_cpus_lock);
+	if (!gb_wmi_cpus_set) {
+		// CPUs isolated with either isolcpus= or nohz_full= are left
+		// alone.
+		spin_lock(&gb_wmi_lock);
+		cpumask_and(&gb_wmi_cpus, housekeeping_cpumask(HK_TYPE_DOMAIN),
+			    housekeeping_cpumask(HK_TYPE_KTHREAD));
+		spin_unlock(&gb_wmi_lock);
+	}
+	// The worker still works on any CPU, so this is not fatal.
+	int err = set_cpus_allowed_ptr(gb_wmi_worker->task, &gb_wmi_cpus);
 	if (err) {
-		return err;
+		pr_warn("Failed to bind the WMI worker to CPUs %*pbl: %d\n",
+			cpumask_pr_args(&gb_wmi_cpus), err);
+	}
+	mutex_unlock(&gb_wmi_cpus_lock);
+
+	gb_debugfs_dir = debugfs_create_dir("gigabyte-wmi", NULL);
+	debugfs_create_file("health", 0444, gb_debugfs_dir, NULL,
+			    &gb_wmi_health_fops);
+	debugfs_create_file("trace", 0600, gb_debugfs_dir, NULL,
+			    &gb_trace_fops);
+	if (replay) {
+		debugfs_create_file("replay", 0200, gb_debugfs_dir, NULL,
+				    &gb_replay_fops);
+	}
+
+	err = platform_driver_register(&gigabyte_wmi_driver);
+	if (err) {
+		goto drv_err;
+	}
+
+	// Without BTF for modules the driver works, only policies cannot be
+	// attached.
+	if (gb_policy_register()) {
+		pr_warn("BPF policies are not available\n");
 	}
 
 	gb_wmi_platform_dev = platform_device_register_simple(
@@ -1111,6 +5460,13 @@ static int __init gigabyte_wmi_init(void)
 		goto pdev_err;
 	}
 
+	// The device is registered even if probe fails, but the attributes
+	// would then have no driver data behind them.
+	if (!platform_get_drvdata(gb_wmi_platform_dev)) {
+		err = -ENODEV;
+		goto dev_err;
+	}
+
 	err = sysfs_create_group(&gb_wmi_platform_dev->dev.kobj,
 				 &fan_control_attribute_group);
 	if (err)
@@ -1131,6 +5487,38 @@ static int __init gigabyte_wmi_init(void)
 				 &gpu_attribute_group);
 	if (err)
 		goto dev_err;
+	err = sysfs_create_group(&gb_wmi_platform_dev->dev.kobj,
+				 &governor_attribute_group);
+	if (err)
+		goto dev_err;
+	err = sysfs_create_group(&gb_wmi_platform_dev->dev.kobj,
+				 &profiles_attribute_group);
+	if (err)
+		goto dev_err;
+	err = sysfs_create_group(&gb_wmi_platform_dev->dev.kobj,
+				 &async_attribute_group);
+	if (err)
+		goto dev_err;
+	err = sysfs_create_group(&gb_wmi_platform_dev->dev.kobj,
+				 &stats_attribute_group);
+	if (err)
+		goto dev_err;
+	err = sysfs_create_group(&gb_wmi_platform_dev->dev.kobj,
+				 &leds_attribute_group);
+	if (err)
+		goto dev_err;
+	err = sysfs_create_group(&gb_wmi_platform_dev->dev.kobj,
+				 &thermal_attribute_group);
+	if (err)
+		goto dev_err;
+	err = sysfs_create_group(&gb_wmi_platform_dev->dev.kobj,
+				 &snapshot_attribute_group);
+	if (err)
+		goto dev_err;
+	err = sysfs_create_group(&gb_wmi_platform_dev->dev.kobj,
+				 &turbo_attribute_group);
+	if (err)
+		goto dev_err;
 
 	return 0;
 
@@ -1138,6 +5526,11 @@ dev_err:
 	platform_device_unregister(gb_wmi_platform_dev);
 pdev_err:
 	platform_driver_unregister(&gigabyte_wmi_driver);
+drv_err:
+	debugfs_remove_recursive(gb_debugfs_dir);
+	kthread_destroy_worker(gb_wmi_worker);
+	vfree(gb_trace.records);
+	vfree(gb_replay.records);
 	return err;
 }
 
@@ -1147,6 +5540,10 @@ static void __exit gigabyte_wmi_cleanup(void)
 		platform_device_unregister(gb_wmi_platform_dev);
 		platform_driver_unregister(&gigabyte_wmi_driver);
 	}
+	debugfs_remove_recursive(gb_debugfs_dir);
+	kthread_destroy_worker(gb_wmi_worker);
+	vfree(gb_trace.records);
+	vfree(gb_replay.records);
 }
 
 module_init(gigabyte_wmi_init);
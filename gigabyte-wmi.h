@@ -0,0 +1,36 @@
+#ifndef GIGABYTE_WMI_H
+#define GIGABYTE_WMI_H
+
+#include <linux/types.h>
+
+#define GB_TRACE_DATA_LEN 16
+
+// One WMI call in the debugfs trace, the trace is a plain array of these.
+// Inputs and outputs longer than GB_TRACE_DATA_LEN are truncated.
+struct gb_trace_record {
+	__u64 timestamp_ns; // CLOCK_MONOTONIC, when the call started
+	__u32 duration_ns;
+	__u32 status; // acpi_status of the call
+	__u16 method_id;
+	__u8 dir; // 0 for get methods, 1 for set methods
+	__u8 in_len;
+	__u8 out_type; // ACPI object type of the result, 0 if there was none
+	__u8 out_len;
+	__u8 reserved[2];
+	__u8 in[GB_TRACE_DATA_LEN];
+	__u8 out[GB_TRACE_DATA_LEN]; // integer in little endian or buffer
+};
+
+#ifdef __KERNEL__
+
+// Accessors the driver uses for the direct EC register fast path. Tests can
+// install their own to run the driver against a simulated EC.
+struct gb_ec_ops {
+	int (*read)(u8 addr, u8 *val);
+};
+
+int gigabyte_wmi_set_ec_ops(const struct gb_ec_ops *ops);
+
+#endif
+
+#endif
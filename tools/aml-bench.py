@@ -0,0 +1,142 @@
+#!/usr/bin/env python3
+"""Benchmark the Gigabyte WMI AML methods offline with ACPICA's acpiexec.
+
+Loads the DSDT and SSDTs dumped from a laptop (see acpi/README.md) into
+acpiexec, finds the WMxx methods behind the get and set GUIDs through _WDG
+and runs them for every method id in the driver's enum. Prints, per method,
+the number of AML opcodes executed and the average execution time.
+
+The time is measured around whole acpiexec runs. A run that only loads the
+tables is subtracted, and the remainder is divided by the number of
+iterations. Opcode counts come from ACPICA's opcode trace points. They need
+an acpiexec built with debug output, which is the default for
+acpica-tools.
+"""
+
+import argparse
+import pathlib
+import re
+import subprocess
+import sys
+import time
+
+GET_GUID = "ABBC0F6F-8EA1-11d1-00A0-C90629100000"
+SET_GUID = "ABBC0F75-8EA1-11d1-00A0-C90629100000"
+
+DRIVER = pathlib.Path(__file__).resolve().parent.parent / "gigabyte-wmi.c"
+
+ENUM_RE = re.compile(
+    r"^\s*(GB_METHOD_\w+)\s*=\s*(\d+),\s*//.*\((Get & Set|Get only|Set only)")
+HEX_RE = re.compile(r"^\s*[0-9A-Fa-f]{4,8}:\s+((?:[0-9A-Fa-f]{2}\s+)+)")
+OPCODE_RE = re.compile(r"\bBegin\s+Opcode\b", re.IGNORECASE)
+
+
+def driver_methods():
+    """Returns (name, id, dirs) for every method in the driver's enum."""
+    methods = []
+    for line in DRIVER.read_text().splitlines():
+        m = ENUM_RE.match(line)
+        if not m:
+            continue
+        kind = m.group(3)
+        dirs = {"Get & Set": ("get", "set"), "Get only": ("get",),
+                "Set only": ("set",)}[kind]
+        methods.append((m.group(1), int(m.group(2)), dirs))
+    return methods
+
+
+def guid_bytes(guid):
+    """Returns the _WDG (little endian, mixed) encoding of a GUID."""
+    parts = guid.split("-")
+    raw = bytes.fromhex(parts[0])[::-1] + bytes.fromhex(parts[1])[::-1] + \
+        bytes.fromhex(parts[2])[::-1] + bytes.fromhex(parts[3] + parts[4])
+    return raw
+
+
+class AcpiExec:
+    def __init__(self, binary, tables):
+        self.binary = binary
+        self.tables = [str(t) for t in tables]
+
+    def run(self, commands):
+        cmd = [self.binary, "-b", ";".join(commands)] + self.tables
+        start = time.perf_counter()
+        res = subprocess.run(cmd, capture_output=True, text=True,
+                             errors="replace")
+        return res.stdout + res.stderr, time.perf_counter() - start
+
+    def find_wmi_methods(self):
+        """Maps the get and set GUIDs to the full path of their WMxx."""
+        out, _ = self.run(["find _WDG"])
+        paths = sorted(set(re.findall(r"(\\[\w.]*_WDG)", out)))
+        found = {}
+        for path in paths:
+            out, _ = self.run([f"evaluate {path}"])
+            data = bytearray()
+            for line in out.splitlines():
+                m = HEX_RE.match(line)
+                if m:
+                    data += bytes.fromhex(m.group(1))
+            device = path[:-len("._WDG")]
+            # Every _WDG entry is 20 bytes: GUID, object id, instance
+            # count and flags.
+            for off in range(0, len(data) - 19, 20):
+                entry = data[off:off + 20]
+                object_id = entry[16:18].decode("ascii", "replace")
+                for guid in (GET_GUID, SET_GUID):
+                    if entry[:16] == guid_bytes(guid):
+                        found[guid] = f"{device}.WM{object_id}"
+        return found
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("tables", type=pathlib.Path,
+                        help="directory with dsdt.dat and ssdt*.dat")
+    parser.add_argument("--acpiexec", default="acpiexec",
+                        help="acpiexec binary to use")
+    parser.add_argument("-n", "--iterations", type=int, default=100,
+                        help="calls per method for the timing runs")
+    parser.add_argument("--no-opcodes", action="store_true",
+                        help="skip the opcode tracing runs")
+    args = parser.parse_args()
+
+    tables = sorted(args.tables.glob("dsdt*.dat")) + \
+        sorted(args.tables.glob("ssdt*.dat"))
+    if not tables:
+        sys.exit(f"{args.tables}: no dsdt.dat or ssdt*.dat found")
+
+    acpi = AcpiExec(args.acpiexec, tables)
+    wmxx = acpi.find_wmi_methods()
+    for guid in (GET_GUID, SET_GUID):
+        if guid not in wmxx:
+            sys.exit(f"No WMxx method found for {guid}")
+    print(f"get: {wmxx[GET_GUID]}  set: {wmxx[SET_GUID]}")
+
+    # Repeat the baseline so that the load time is not noise dominated.
+    baseline = min(acpi.run(["help"])[1] for _ in range(3))
+
+    print(f"{'method':<40} {'dir':>3} {'id':>3} {'opcodes':>8} "
+          f"{'us/call':>9}")
+    for name, method_id, dirs in driver_methods():
+        for direction in dirs:
+            path = wmxx[GET_GUID if "get" == direction else SET_GUID]
+            # Instance 0, method id, a zeroed 4 byte input buffer, the
+            # same shape the driver passes for single value inputs.
+            call = f"execute {path} 0 {method_id} (00 00 00 00)"
+
+            opcodes = "-"
+            if not args.no_opcodes:
+                out, _ = acpi.run([f"trace opcode {path} once", call])
+                count = len(OPCODE_RE.findall(out))
+                if count:
+                    opcodes = str(count)
+
+            _, elapsed = acpi.run([call] * args.iterations)
+            us = max(0.0, elapsed - baseline) / args.iterations * 1e6
+            print(f"{name:<40} {direction:>3} {method_id:>3} "
+                  f"{opcodes:>8} {us:>9.1f}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,310 @@
+#!/usr/bin/env python3
+"""Find the firmware settings with the best sustained benchmark score.
+
+Sweeps combinations of whisper mode, dynamic boost, the Nvidia power config
+and thermal target, and the fan speed through the gigabyte-wmi driver. For
+every combination the benchmark command is run several times back to back.
+The score of a run is the last number it prints, or the first group of
+--score-regex. The first runs warm the machine up, and the median of the
+rest is the sustained score. Temperatures and fan RPMs are sampled from the
+driver's snapshot attribute while the benchmark runs.
+
+A combination is dropped as soon as the driver's throttle detection reports
+an event or a temperature passes --max-temp. Every untried combination that
+can only run hotter, with more boost, less fan or a higher thermal target,
+is then skipped too. The result is a ranking and the best profile in the
+format of profiles/apply and the profile module parameter.
+"""
+
+import argparse
+import itertools
+import json
+import pathlib
+import re
+import shlex
+import statistics
+import subprocess
+import sys
+import threading
+import time
+
+DRIVER = pathlib.Path("/sys/devices/platform/gigabyte-wmi")
+NUMBER_RE = re.compile(r"[-+]?\d+(?:\.\d+)?")
+
+# Knobs in sweep order, with the settings that hold the machine coolest
+# first.
+KNOBS = ("whisper_mode", "dynamic_boost_status", "nv_power_config",
+         "nv_thermal_target", "fan_speed")
+# Settings restored when the sweep ends.
+RESTORE = ("whisper_mode", "dynamic_boost_status", "nv_power_config",
+           "nv_thermal_target", "auto_fan_status", "fixed_fan_status",
+           "fixed_fan_speed")
+
+
+class Driver:
+    def __init__(self, root):
+        self.root = root
+
+    def snapshot(self):
+        values = {}
+        for line in (self.root / "snapshot").read_text().splitlines():
+            name, _, value = line.partition("=")
+            if value:
+                values[name] = int(value)
+        return values
+
+    def write(self, path, value):
+        (self.root / path).write_text(f"{value}\n")
+
+    def read(self, path):
+        return (self.root / path).read_text()
+
+    def apply(self, profile):
+        self.write("profiles/apply", ",".join(
+            f"{name}={value}" for name, value in profile.items()))
+
+    def throttle_events(self):
+        status = {}
+        for line in self.read("thermal/throttle_status").splitlines():
+            name, _, value = line.partition("=")
+            status[name] = value
+        return sum(int(status.get(key, 0))
+                   for key in ("cpu_events", "gpu_events",
+                               "fan_stall_events"))
+
+
+def profile_for(setting):
+    """Driver profile of a sweep point."""
+    profile = {knob: setting[knob] for knob in KNOBS if knob != "fan_speed"}
+    if "auto" == setting["fan_speed"]:
+        profile.update(fixed_fan_status=0, auto_fan_status=1)
+    else:
+        profile.update(auto_fan_status=0, fixed_fan_status=1,
+                       fixed_fan_speed=setting["fan_speed"])
+    return profile
+
+
+def fan_rank(speed):
+    # Automatic fan control counts as the slowest fan.
+    return -1 if "auto" == speed else speed
+
+
+def hotter_or_equal(a, b):
+    """True if setting a cannot run cooler than setting b."""
+    return (a["whisper_mode"] <= b["whisper_mode"] and
+            a["dynamic_boost_status"] >= b["dynamic_boost_status"] and
+            a["nv_power_config"] == b["nv_power_config"] and
+            (a["nv_thermal_target"] == b["nv_thermal_target"] or
+             (a["nv_thermal_target"] and b["nv_thermal_target"] and
+              a["nv_thermal_target"] >= b["nv_thermal_target"])) and
+            fan_rank(a["fan_speed"]) <= fan_rank(b["fan_speed"]))
+
+
+class Monitor(threading.Thread):
+    """Samples the sensors while a benchmark runs."""
+
+    def __init__(self, driver, interval, max_temp):
+        super().__init__(daemon=True)
+        self.driver = driver
+        self.interval = interval
+        self.max_temp = max_temp
+        self.samples = []
+        self.too_hot = False
+        self.stop = threading.Event()
+
+    def run(self):
+        while not self.stop.wait(self.interval):
+            try:
+                values = self.driver.snapshot()
+            except OSError:
+                continue
+            self.samples.append(values)
+            temps = [values[k] for k in ("cpu_temp", "gpu_temp1",
+                                         "gpu_temp2") if k in values]
+            if temps and max(temps) > self.max_temp:
+                self.too_hot = True
+
+    def summary(self):
+        out = {}
+        for key in ("cpu_temp", "gpu_temp1", "gpu_temp2", "rpm1", "rpm2"):
+            values = [s[key] for s in self.samples if key in s]
+            if values:
+                out[key] = {"mean": round(statistics.mean(values), 1),
+                            "max": max(values)}
+        return out
+
+
+def run_benchmark(args, driver, monitor):
+    """Runs the command once. Returns its score, or None if pruned."""
+    proc = subprocess.Popen(args.command, shell=True, text=True,
+                            stdout=subprocess.PIPE)
+    output = []
+    reader = threading.Thread(target=lambda: output.extend(proc.stdout),
+                              daemon=True)
+    reader.start()
+    while proc.poll() is None:
+        if monitor.too_hot or driver.throttle_events() > args.max_throttle:
+            proc.kill()
+            proc.wait()
+            return None
+        time.sleep(args.interval)
+    reader.join()
+    if proc.returncode:
+        sys.exit(f"benchmark exited with status {proc.returncode}")
+
+    text = "".join(output)
+    if args.score_regex:
+        m = re.search(args.score_regex, text)
+        if not m:
+            sys.exit(f"--score-regex did not match:\n{text}")
+        return float(m.group(1))
+    numbers = NUMBER_RE.findall(text)
+    if not numbers:
+        sys.exit(f"benchmark printed no score:\n{text}")
+    return float(numbers[-1])
+
+
+def cool_down(args, driver):
+    deadline = time.monotonic() + args.cool_timeout
+    while time.monotonic() < deadline:
+        values = driver.snapshot()
+        if values.get("cpu_temp", 0) <= args.cool_temp:
+            return
+        time.sleep(args.interval)
+
+
+def evaluate(args, driver, setting):
+    driver.apply(profile_for(setting))
+    cool_down(args, driver)
+    driver.write("thermal/reset", 1)
+
+    monitor = Monitor(driver, args.interval, args.max_temp)
+    monitor.start()
+    scores = []
+    pruned = False
+    for _ in range(args.warmup + args.runs):
+        score = run_benchmark(args, driver, monitor)
+        if score is None:
+            pruned = True
+            break
+        scores.append(score)
+    monitor.stop.set()
+    monitor.join()
+
+    sustained = scores[args.warmup:]
+    return {
+        "setting": setting,
+        "pruned": pruned,
+        "score": statistics.median(sustained) if sustained and not pruned
+        else None,
+        "scores": scores,
+        "sensors": monitor.summary(),
+    }
+
+
+def int_list(text):
+    return [int(v) for v in text.split(",")]
+
+
+def fan_list(text):
+    return [v if "auto" == v else int(v) for v in text.split(",")]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("command", nargs="+",
+                        help="benchmark command, run through the shell")
+    parser.add_argument("--score-regex",
+                        help="regex whose first group is the score")
+    parser.add_argument("--lower-is-better", action="store_true",
+                        help="the score is a time, not a throughput")
+    parser.add_argument("--runs", type=int, default=3,
+                        help="measured runs per setting")
+    parser.add_argument("--warmup", type=int, default=1,
+                        help="runs per setting that are not measured")
+    parser.add_argument("--whisper", type=int_list, default=[0, 1])
+    parser.add_argument("--boost", type=int_list, default=[0, 1])
+    parser.add_argument("--nv-power-config", type=int_list, default=[1])
+    parser.add_argument("--nv-thermal-target", type=int_list,
+                        default=[0, 75, 87],
+                        help="0 keeps the firmware default")
+    parser.add_argument("--fan-speed", type=fan_list,
+                        default=["auto", 160, 200, 229],
+                        help="fixed fan speeds, auto for automatic control")
+    parser.add_argument("--max-temp", type=int, default=95,
+                        help="prune a setting above this temperature")
+    parser.add_argument("--max-throttle", type=int, default=0,
+                        help="throttle events a setting may cause")
+    parser.add_argument("--cool-temp", type=int, default=60,
+                        help="CPU temperature to wait for between settings")
+    parser.add_argument("--cool-timeout", type=float, default=120)
+    parser.add_argument("--interval", type=float, default=1.0,
+                        help="sensor sampling interval in seconds")
+    parser.add_argument("--json", type=pathlib.Path,
+                        help="also write all results to this file")
+    parser.add_argument("--driver", type=pathlib.Path, default=DRIVER)
+    args = parser.parse_args()
+    args.command = " ".join(shlex.quote(c) for c in args.command) \
+        if len(args.command) > 1 else args.command[0]
+
+    driver = Driver(args.driver)
+    saved = {k: v for k, v in driver.snapshot().items() if k in RESTORE}
+    throttle_enabled = int(driver.read("thermal/enabled"))
+
+    # Pruning needs every knob coolest first: whisper on, boost off, the
+    # lowest thermal target and the fastest fan. The default thermal target
+    # and the power configs are only compared for equality.
+    grid = [dict(zip(KNOBS, values)) for values in itertools.product(
+        sorted(args.whisper, reverse=True), sorted(args.boost),
+        args.nv_power_config, sorted(args.nv_thermal_target),
+        sorted(args.fan_speed, key=fan_rank, reverse=True))]
+
+    results = []
+    throttled = []
+    driver.write("thermal/enabled", 1)
+    try:
+        for n, setting in enumerate(grid, 1):
+            label = " ".join(f"{k}={v}" for k, v in setting.items())
+            if any(hotter_or_equal(setting, t) for t in throttled):
+                print(f"[{n}/{len(grid)}] {label}: skipped")
+                continue
+            result = evaluate(args, driver, setting)
+            results.append(result)
+            if result["pruned"]:
+                throttled.append(setting)
+                print(f"[{n}/{len(grid)}] {label}: throttled")
+            else:
+                print(f"[{n}/{len(grid)}] {label}: {result['score']:g}")
+    finally:
+        driver.apply(saved)
+        driver.write("thermal/enabled", throttle_enabled)
+
+    ranked = sorted((r for r in results if not r["pruned"]),
+                    key=lambda r: r["score"],
+                    reverse=not args.lower_is_better)
+    if not ranked:
+        sys.exit("Every setting throttled")
+
+    print(f"\n{'score':>10} {'cpu max':>8} {'gpu max':>8} {'rpm1':>6}  "
+          "setting")
+    for r in ranked:
+        sensors = r["sensors"]
+        gpu = max((sensors[k]["max"] for k in ("gpu_temp1", "gpu_temp2")
+                   if k in sensors), default="-")
+        print(f"{r['score']:>10g} "
+              f"{sensors.get('cpu_temp', {}).get('max', '-'):>8} "
+              f"{gpu:>8} "
+              f"{sensors.get('rpm1', {}).get('mean', '-'):>6}  "
+              + " ".join(f"{k}={v}" for k, v in r["setting"].items()))
+
+    best = ",".join(f"{k}={v}"
+                    for k, v in profile_for(ranked[0]["setting"]).items())
+    print(f"\nBest profile:\n{best}")
+
+    if args.json:
+        args.json.write_text(json.dumps(
+            {"results": results, "best": best}, indent=2))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,176 @@
+// Prometheus exporter for the gigabyte-wmi driver.
+//
+// Serves the values reported by the driver as Prometheus metrics over HTTP
+// on localhost. The values are read through libgbwmi, which keeps the
+// driver's files open between scrapes.
+//
+// Build: make -C tools
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "libgbwmi.h"
+
+#define DEFAULT_PORT 9477
+// Clients are served one at a time, so one that stops sending or reading
+// would block every scrape after it.
+#define CLIENT_TIMEOUT_S 5
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-p port] [-d dir]\n"
+		"  -p port  TCP port on 127.0.0.1 to listen on (default %d)\n"
+		"  -d dir   driver sysfs directory (default %s)\n",
+		prog, DEFAULT_PORT, GBWMI_DEFAULT_DIR);
+}
+
+// Formats the values as metrics, returns the length of the text.
+static size_t format_metrics(const struct gbwmi_values *values, char *out,
+			     size_t size)
+{
+	size_t len = 0;
+
+	for (int i = 0; i < GBWMI_VALUE_COUNT; ++i) {
+		if (!GBWMI_VALID(values, i)) {
+			continue;
+		}
+
+		const char *name = gbwmi_value_name(i);
+		int n = snprintf(out + len, size - len,
+				 "# TYPE gigabyte_wmi_%s gauge\n"
+				 "gigabyte_wmi_%s %ld\n",
+				 name, name, values->value[i]);
+		if (n < 0 || (size_t)n >= size - len) {
+			break;
+		}
+		len += n;
+	}
+
+	return len;
+}
+
+static void write_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			return;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static void serve(int client, struct gbwmi *wmi)
+{
+	char req[1024];
+	ssize_t n = read(client, req, sizeof(req) - 1);
+	if (n <= 0) {
+		return;
+	}
+	req[n] = '\0';
+
+	if (strncmp(req, "GET /metrics ", 13) && strncmp(req, "GET / ", 6)) {
+		static const char not_found[] =
+			"HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+		write_all(client, not_found, sizeof(not_found) - 1);
+		return;
+	}
+
+	struct gbwmi_values values;
+	if (gbwmi_read(wmi, &values)) {
+		static const char unavailable[] =
+			"HTTP/1.0 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n";
+		write_all(client, unavailable, sizeof(unavailable) - 1);
+		return;
+	}
+	char body[16384];
+	size_t body_len = format_metrics(&values, body, sizeof(body));
+
+	char head[128];
+	int head_len = snprintf(head, sizeof(head),
+				"HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: %zu\r\n\r\n",
+				body_len);
+	write_all(client, head, head_len);
+	write_all(client, body, body_len);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dir = GBWMI_DEFAULT_DIR;
+	int port = DEFAULT_PORT;
+
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "p:d:h"))) {
+		switch (opt) {
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	struct gbwmi *wmi = gbwmi_open(dir);
+	if (!wmi) {
+		perror(dir);
+		return 1;
+	}
+
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		return 1;
+	}
+	int on = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(sock, 16)) {
+		perror("bind");
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	for (;;) {
+		int client = accept(sock, NULL, NULL);
+		if (client < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			perror("accept");
+			return 1;
+		}
+		struct timeval timeout = { .tv_sec = CLIENT_TIMEOUT_S };
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+			   sizeof(timeout));
+		setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+			   sizeof(timeout));
+		serve(client, wmi);
+		close(client);
+	}
+}
@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+"""Summarize gigabyte-wmi call traces.
+
+Prints call counts, throughput and latency percentiles per WMI method for a
+trace read from /sys/kernel/debug/gigabyte-wmi/trace. Given two traces, for
+example one recorded on the laptop and one recorded while replaying it
+against a different build, prints both side by side.
+"""
+
+import argparse
+import struct
+import sys
+from collections import defaultdict
+
+# Matches struct gb_trace_record in gigabyte-wmi.h.
+RECORD = struct.Struct("<QIIHBBBB2x16s16s")
+DIRS = ("get", "set")
+
+
+def load(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    if len(data) % RECORD.size:
+        sys.exit(f"{path}: not a whole number of {RECORD.size} byte records")
+    return [RECORD.unpack_from(data, off)
+            for off in range(0, len(data), RECORD.size)]
+
+
+def percentile(values, p):
+    idx = min(len(values) - 1, int(round(p / 100 * (len(values) - 1))))
+    return values[idx]
+
+
+def summarize(records):
+    calls = defaultdict(list)
+    for ts, duration, status, method, direction, *_ in records:
+        calls[(DIRS[direction], method)].append(duration / 1000)
+    summary = {}
+    for key, durations in calls.items():
+        durations.sort()
+        summary[key] = (len(durations), percentile(durations, 50),
+                        percentile(durations, 99), durations[-1])
+    span = (records[-1][0] - records[0][0]) / 1e9 if len(records) > 1 else 0
+    return summary, span
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("trace", nargs="+", help="trace file, at most two")
+    args = parser.parse_args()
+    if len(args.trace) > 2:
+        parser.error("at most two traces can be compared")
+
+    results = []
+    for path in args.trace:
+        records = load(path)
+        if not records:
+            sys.exit(f"{path}: empty trace")
+        summary, span = summarize(records)
+        rate = len(records) / span if span else 0
+        print(f"{path}: {len(records)} calls in {span:.3f} s, "
+              f"{rate:.1f} calls/s")
+        results.append(summary)
+
+    header = f"{'method':>8} " + " | ".join(
+        f"{'calls':>6} {'p50 us':>9} {'p99 us':>9} {'max us':>9}"
+        for _ in results)
+    print(header)
+    for key in sorted(set().union(*results)):
+        cols = []
+        for summary in results:
+            if key in summary:
+                count, p50, p99, worst = summary[key]
+                cols.append(f"{count:>6} {p50:>9.1f} {p99:>9.1f} "
+                            f"{worst:>9.1f}")
+            else:
+                cols.append(f"{'-':>6} {'-':>9} {'-':>9} {'-':>9}")
+        print(f"{key[0]:>4} {key[1]:>3} " + " | ".join(cols))
+
+
+if __name__ == "__main__":
+    main()
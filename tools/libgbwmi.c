@@ -0,0 +1,262 @@
+// libgbwmi: user space access to the gigabyte-wmi driver.
+//
+// Build: make -C tools libgbwmi.a
+
+#define _GNU_SOURCE
+
+#include "libgbwmi.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const struct {
+	const char *name;
+	// Attribute of the value relative to the driver directory, NULL if the
+	// value is only reported by the snapshot.
+	const char *path;
+} gbwmi_values[GBWMI_VALUE_COUNT] = {
+	[GBWMI_CPU_TEMP] = { "cpu_temp", NULL },
+	[GBWMI_GPU_TEMP1] = { "gpu_temp1", "sensors/gpu_temp1" },
+	[GBWMI_GPU_TEMP2] = { "gpu_temp2", "sensors/gpu_temp2" },
+	[GBWMI_RPM1] = { "rpm1", NULL },
+	[GBWMI_RPM2] = { "rpm2", NULL },
+	[GBWMI_AUTO_FAN_STATUS] = { "auto_fan_status",
+				    "fan_control/auto_fan_status" },
+	[GBWMI_FIXED_FAN_STATUS] = { "fixed_fan_status",
+				     "fan_control/fixed_fan_status" },
+	[GBWMI_STEP_FAN_STATUS] = { "step_fan_status",
+				    "fan_control/step_fan_status" },
+	[GBWMI_FIXED_FAN_SPEED] = { "fixed_fan_speed",
+				    "fan_control/fixed_fan_speed" },
+	[GBWMI_CPU_FAN_DUTY] = { "cpu_fan_duty", "fan_control/cpu_fan_duty" },
+	[GBWMI_GPU_FAN_DUTY] = { "gpu_fan_duty", "fan_control/gpu_fan_duty" },
+	[GBWMI_DYNAMIC_BOOST_STATUS] = { "dynamic_boost_status",
+					 "performance/dynamic_boost_status" },
+	[GBWMI_AI_BOOST_STATUS] = { "ai_boost_status", NULL },
+	[GBWMI_WHISPER_MODE] = { "whisper_mode", "performance/whisper_mode" },
+	[GBWMI_NV_POWER_CONFIG] = { "nv_power_config", "gpu/nv_power_config" },
+	[GBWMI_NV_THERMAL_TARGET] = { "nv_thermal_target",
+				      "gpu/nv_thermal_target" },
+	[GBWMI_BATTERY_HEALTH] = { "battery_health", "battery/battery_health" },
+	[GBWMI_BATTERY_CYCLE_COUNT] = { "battery_cycle_count",
+					"battery/battery_cycle_count" },
+};
+
+// Attributes are opened read-only. A tool that only reads, like the
+// exporter, then holds no descriptor that could change a setting, even when
+// it runs as root. The write descriptors are opened on the first write.
+struct gbwmi {
+	int dirfd;
+	int fd[GBWMI_VALUE_COUNT]; // -1 if the driver has no such attribute
+	int wfd[GBWMI_VALUE_COUNT]; // -1 until the value is first written
+	int snapshot_fd;
+	int apply_fd; // -1 until the first profile is applied
+	char buf[4096];
+};
+
+static void gbwmi_close_fd(int fd)
+{
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+// Returns the cached write descriptor of path, opening it if needed.
+static int gbwmi_open_write(struct gbwmi *h, int *fd, const char *path)
+{
+	if (*fd < 0) {
+		*fd = openat(h->dirfd, path, O_WRONLY | O_CLOEXEC);
+		if (*fd < 0) {
+			return -errno;
+		}
+	}
+
+	return *fd;
+}
+
+struct gbwmi *gbwmi_open(const char *dir)
+{
+	int dirfd = open(dir ? dir : GBWMI_DEFAULT_DIR,
+			 O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0) {
+		return NULL;
+	}
+
+	struct gbwmi *h = malloc(sizeof(*h));
+	if (!h) {
+		close(dirfd);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	h->dirfd = dirfd;
+	for (int i = 0; i < GBWMI_VALUE_COUNT; ++i) {
+		h->fd[i] = gbwmi_values[i].path ?
+				   openat(dirfd, gbwmi_values[i].path,
+					  O_RDONLY | O_CLOEXEC) :
+				   -1;
+		h->wfd[i] = -1;
+	}
+	h->snapshot_fd = openat(dirfd, "snapshot", O_RDONLY | O_CLOEXEC);
+	h->apply_fd = -1;
+
+	return h;
+}
+
+void gbwmi_close(struct gbwmi *h)
+{
+	if (!h) {
+		return;
+	}
+
+	for (int i = 0; i < GBWMI_VALUE_COUNT; ++i) {
+		gbwmi_close_fd(h->fd[i]);
+		gbwmi_close_fd(h->wfd[i]);
+	}
+	gbwmi_close_fd(h->snapshot_fd);
+	gbwmi_close_fd(h->apply_fd);
+	close(h->dirfd);
+	free(h);
+}
+
+const char *gbwmi_value_name(enum gbwmi_value v)
+{
+	if (v < 0 || v >= GBWMI_VALUE_COUNT) {
+		return NULL;
+	}
+
+	return gbwmi_values[v].name;
+}
+
+// sysfs regenerates an attribute on every read from offset 0.
+static ssize_t gbwmi_pread(struct gbwmi *h, int fd)
+{
+	ssize_t len = pread(fd, h->buf, sizeof(h->buf) - 1, 0);
+	if (len < 0) {
+		return -errno;
+	}
+	h->buf[len] = '\0';
+
+	return len;
+}
+
+int gbwmi_get(struct gbwmi *h, enum gbwmi_value v, long *value)
+{
+	if (v < 0 || v >= GBWMI_VALUE_COUNT) {
+		return -EINVAL;
+	}
+	if (h->fd[v] < 0) {
+		return -ENOENT;
+	}
+
+	ssize_t len = gbwmi_pread(h, h->fd[v]);
+	if (len < 0) {
+		return len;
+	}
+
+	char *end;
+	errno = 0;
+	*value = strtol(h->buf, &end, 10);
+	if (errno || end == h->buf) {
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int gbwmi_set(struct gbwmi *h, enum gbwmi_value v, long value)
+{
+	if (v < 0 || v >= GBWMI_VALUE_COUNT) {
+		return -EINVAL;
+	}
+	if (!gbwmi_values[v].path) {
+		return -ENOENT;
+	}
+
+	int fd = gbwmi_open_write(h, &h->wfd[v], gbwmi_values[v].path);
+	if (fd < 0) {
+		return fd;
+	}
+
+	int len = snprintf(h->buf, sizeof(h->buf), "%ld\n", value);
+	if (pwrite(fd, h->buf, len, 0) < 0) {
+		return -errno;
+	}
+
+	return 0;
+}
+
+// Parses the "name=value" lines of the snapshot. The driver reports the
+// values in enum order, so the lookup starts after the previous match.
+static void gbwmi_parse_snapshot(const char *text, struct gbwmi_values *values)
+{
+	int hint = 0;
+	const char *line = text;
+
+	while (*line) {
+		const char *eq = strchr(line, '=');
+		if (!eq) {
+			break;
+		}
+		size_t name_len = eq - line;
+
+		for (int n = 0; n < GBWMI_VALUE_COUNT; ++n) {
+			int i = (hint + n) % GBWMI_VALUE_COUNT;
+			const char *name = gbwmi_values[i].name;
+			if (strlen(name) == name_len &&
+			    !memcmp(name, line, name_len)) {
+				values->value[i] = strtol(eq + 1, NULL, 10);
+				values->valid |= 1u << i;
+				hint = i + 1;
+				break;
+			}
+		}
+
+		const char *end = strchr(eq, '\n');
+		if (!end) {
+			break;
+		}
+		line = end + 1;
+	}
+}
+
+int gbwmi_read(struct gbwmi *h, struct gbwmi_values *values)
+{
+	values->valid = 0;
+
+	if (h->snapshot_fd >= 0) {
+		ssize_t len = gbwmi_pread(h, h->snapshot_fd);
+		if (len < 0) {
+			return len;
+		}
+		gbwmi_parse_snapshot(h->buf, values);
+		return 0;
+	}
+
+	// Drivers without the snapshot attribute.
+	for (int i = 0; i < GBWMI_VALUE_COUNT; ++i) {
+		if (!gbwmi_get(h, i, &values->value[i])) {
+			values->valid |= 1u << i;
+		}
+	}
+
+	return 0;
+}
+
+int gbwmi_apply_profile(struct gbwmi *h, const char *profile)
+{
+	int fd = gbwmi_open_write(h, &h->apply_fd, "profiles/apply");
+	if (fd < 0) {
+		return fd;
+	}
+
+	if (pwrite(fd, profile, strlen(profile), 0) < 0) {
+		return -errno;
+	}
+
+	return 0;
+}
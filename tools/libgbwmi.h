@@ -0,0 +1,198 @@
+// libgbwmi: user space access to the gigabyte-wmi driver.
+//
+// A handle keeps the driver's attribute files open and reads them with
+// pread() into a buffer allocated with the handle, so no call after
+// gbwmi_open() allocates memory. The files are opened read-only; the first
+// write to an attribute opens it for writing once. A handle is not thread
+// safe, use one per thread.
+//
+// Functions that return int return 0 on success and a negative errno value
+// on failure.
+
+#ifndef LIBGBWMI_H
+#define LIBGBWMI_H
+
+#include <errno.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GBWMI_DEFAULT_DIR "/sys/devices/platform/gigabyte-wmi"
+
+// Values the driver reports, grouped like its attribute directories.
+enum gbwmi_value {
+	// Sensors
+	GBWMI_CPU_TEMP,
+	GBWMI_GPU_TEMP1,
+	GBWMI_GPU_TEMP2,
+	GBWMI_RPM1,
+	GBWMI_RPM2,
+	// Fan control
+	GBWMI_AUTO_FAN_STATUS,
+	GBWMI_FIXED_FAN_STATUS,
+	GBWMI_STEP_FAN_STATUS,
+	GBWMI_FIXED_FAN_SPEED,
+	GBWMI_CPU_FAN_DUTY,
+	GBWMI_GPU_FAN_DUTY,
+	// Performance
+	GBWMI_DYNAMIC_BOOST_STATUS,
+	GBWMI_AI_BOOST_STATUS,
+	GBWMI_WHISPER_MODE,
+	// GPU
+	GBWMI_NV_POWER_CONFIG,
+	GBWMI_NV_THERMAL_TARGET,
+	// Battery
+	GBWMI_BATTERY_HEALTH,
+	GBWMI_BATTERY_CYCLE_COUNT,
+	GBWMI_VALUE_COUNT
+};
+
+// Result of a batch read.
+struct gbwmi_values {
+	uint32_t valid; // bit per gbwmi_value that was read
+	long value[GBWMI_VALUE_COUNT];
+};
+
+#define GBWMI_VALID(values, v) (((values)->valid >> (v)) & 1)
+
+struct gbwmi;
+
+// Opens the driver at dir, GBWMI_DEFAULT_DIR if dir is NULL. Returns NULL and
+// sets errno on failure.
+struct gbwmi *gbwmi_open(const char *dir);
+void gbwmi_close(struct gbwmi *h);
+
+// Name of a value as the driver reports it, e.g. "cpu_fan_duty".
+const char *gbwmi_value_name(enum gbwmi_value v);
+
+// Reads or writes a single value. -ENOENT if the driver has no attribute for
+// it; some values are only available through gbwmi_read(). Writing needs
+// root.
+int gbwmi_get(struct gbwmi *h, enum gbwmi_value v, long *value);
+int gbwmi_set(struct gbwmi *h, enum gbwmi_value v, long value);
+
+// Reads every value the driver offers. Uses the snapshot attribute, one read
+// for all values, when the driver has it and the per-value attributes
+// otherwise. Values that cannot be read are left out of values->valid.
+int gbwmi_read(struct gbwmi *h, struct gbwmi_values *values);
+
+// Applies a profile in the driver's "name=value ..." format in one call.
+int gbwmi_apply_profile(struct gbwmi *h, const char *profile);
+
+// Typed accessors for the values that can be written, getters first.
+static inline int gbwmi_get_uint(struct gbwmi *h, enum gbwmi_value v,
+				 unsigned int *value)
+{
+	long raw;
+	int err = gbwmi_get(h, v, &raw);
+	if (err) {
+		return err;
+	}
+	if (raw < 0) {
+		return -EIO;
+	}
+
+	*value = raw;
+	return 0;
+}
+
+static inline int gbwmi_get_cpu_fan_duty(struct gbwmi *h, unsigned int *duty)
+{
+	return gbwmi_get_uint(h, GBWMI_CPU_FAN_DUTY, duty);
+}
+
+static inline int gbwmi_get_gpu_fan_duty(struct gbwmi *h, unsigned int *duty)
+{
+	return gbwmi_get_uint(h, GBWMI_GPU_FAN_DUTY, duty);
+}
+
+static inline int gbwmi_get_fixed_fan(struct gbwmi *h, int *enabled,
+				      unsigned int *speed)
+{
+	unsigned int status;
+	int err = gbwmi_get_uint(h, GBWMI_FIXED_FAN_STATUS, &status);
+	if (err) {
+		return err;
+	}
+
+	err = gbwmi_get_uint(h, GBWMI_FIXED_FAN_SPEED, speed);
+	if (err) {
+		return err;
+	}
+
+	*enabled = !!status;
+	return 0;
+}
+
+static inline int gbwmi_get_dynamic_boost(struct gbwmi *h, int *enabled)
+{
+	unsigned int status;
+	int err = gbwmi_get_uint(h, GBWMI_DYNAMIC_BOOST_STATUS, &status);
+	if (!err) {
+		*enabled = !!status;
+	}
+
+	return err;
+}
+
+static inline int gbwmi_get_whisper_mode(struct gbwmi *h, int *enabled)
+{
+	unsigned int status;
+	int err = gbwmi_get_uint(h, GBWMI_WHISPER_MODE, &status);
+	if (!err) {
+		*enabled = !!status;
+	}
+
+	return err;
+}
+
+static inline int gbwmi_get_nv_thermal_target(struct gbwmi *h,
+					      unsigned int *target)
+{
+	return gbwmi_get_uint(h, GBWMI_NV_THERMAL_TARGET, target);
+}
+
+static inline int gbwmi_set_cpu_fan_duty(struct gbwmi *h, unsigned int duty)
+{
+	return gbwmi_set(h, GBWMI_CPU_FAN_DUTY, duty);
+}
+
+static inline int gbwmi_set_gpu_fan_duty(struct gbwmi *h, unsigned int duty)
+{
+	return gbwmi_set(h, GBWMI_GPU_FAN_DUTY, duty);
+}
+
+static inline int gbwmi_set_fixed_fan(struct gbwmi *h, int enabled,
+				      unsigned int speed)
+{
+	int err = gbwmi_set(h, GBWMI_FIXED_FAN_SPEED, speed);
+	if (err) {
+		return err;
+	}
+
+	return gbwmi_set(h, GBWMI_FIXED_FAN_STATUS, !!enabled);
+}
+
+static inline int gbwmi_set_dynamic_boost(struct gbwmi *h, int enabled)
+{
+	return gbwmi_set(h, GBWMI_DYNAMIC_BOOST_STATUS, !!enabled);
+}
+
+static inline int gbwmi_set_whisper_mode(struct gbwmi *h, int enabled)
+{
+	return gbwmi_set(h, GBWMI_WHISPER_MODE, !!enabled);
+}
+
+static inline int gbwmi_set_nv_thermal_target(struct gbwmi *h,
+					      unsigned int target)
+{
+	return gbwmi_set(h, GBWMI_NV_THERMAL_TARGET, target);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBGBWMI_H